@@ -0,0 +1,414 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "consumer.h"
+#include "ring.h"
+#include "flowhash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+/* frames are rotated so the parse isn't always of the same cache line */
+#define FRAMES 1024
+#define FRAME_SIZE 256
+
+static const char* shortopts = "n:h";
+static struct option longopts[]= {
+  {"iterations", required_argument, 0, 'n'},
+  {"help",       no_argument,       0, 'h'},
+  {0, 0, 0, 0}
+};
+
+static void show_usage(void){
+  printf("consumer-bench\n");
+  printf("usage: consumer-bench [OPTIONS]\n");
+  printf("  -n, --iterations=N   Frames parsed per case [default: 20000000]\n");
+  printf("  -h, --help           This text.\n");
+}
+
+static char frames[FRAMES][FRAME_SIZE] __attribute__((aligned(64)));
+static volatile uint64_t sink; /* keeps the results alive */
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Write an ethernet header (with an optional vlan tag) and return a pointer
+ * past it.
+ */
+static char* put_eth(char* ptr, uint16_t ethertype, int vlan){
+  struct ethhdr* eth = (struct ethhdr*)ptr;
+  memset(eth, 0, sizeof(struct ethhdr));
+  eth->h_dest[5] = 1;
+  eth->h_source[5] = 2;
+  ptr += sizeof(struct ethhdr);
+
+  if ( vlan ){
+    eth->h_proto = htons(ETHERTYPE_VLAN);
+    uint16_t tag[2] = {htons(vlan), htons(ethertype)};
+    memcpy(ptr, tag, sizeof(tag));
+    ptr += sizeof(tag);
+  } else {
+    eth->h_proto = htons(ethertype);
+  }
+
+  return ptr;
+}
+
+static char* put_tcp(char* ptr, int n){
+  struct tcphdr* tcp = (struct tcphdr*)ptr;
+  memset(tcp, 0, sizeof(struct tcphdr));
+  tcp->source = htons(1024 + n);
+  tcp->dest = htons(80);
+  tcp->doff = 5;
+  return ptr + sizeof(struct tcphdr);
+}
+
+static char* put_ipv4(char* ptr, int n, int proto){
+  struct ip* ip = (struct ip*)ptr;
+  memset(ip, 0, sizeof(struct ip));
+  ip->ip_v = 4;
+  ip->ip_hl = 5;
+  ip->ip_ttl = 64;
+  ip->ip_p = proto;
+  ip->ip_src.s_addr = htonl(0x0a000000 | n);
+  ip->ip_dst.s_addr = htonl(0x0a010001);
+  return ptr + sizeof(struct ip);
+}
+
+static char* put_udp(char* ptr, int n, uint16_t dport){
+  struct udphdr* udp = (struct udphdr*)ptr;
+  memset(udp, 0, sizeof(struct udphdr));
+  udp->source = htons(1024 + n);
+  udp->dest = htons(dport);
+  return ptr + sizeof(struct udphdr);
+}
+
+/**
+ * Plain 4 byte GRE header (no checksum, key or sequence number).
+ */
+static char* put_gre(char* ptr, uint16_t ethertype){
+  uint16_t hdr[2] = {0, htons(ethertype)};
+  memcpy(ptr, hdr, sizeof(hdr));
+  return ptr + sizeof(hdr);
+}
+
+static char* put_vxlan(char* ptr, int vni){
+  uint8_t hdr[8] = {0x08, 0, 0, 0, vni >> 16, vni >> 8, vni, 0};
+  memcpy(ptr, hdr, sizeof(hdr));
+  return ptr + sizeof(hdr);
+}
+
+/**
+ * GTPv1-U G-PDU header without the optional fields.
+ */
+static char* put_gtpu(char* ptr, int teid){
+  uint8_t hdr[8] = {0x30, 0xff, 0, 0, teid >> 24, teid >> 16, teid >> 8, teid};
+  memcpy(ptr, hdr, sizeof(hdr));
+  return ptr + sizeof(hdr);
+}
+
+/**
+ * IPv6 header followed by ext extension headers (alternating hop-by-hop and
+ * destination options, 8 bytes each).
+ */
+static char* put_ipv6(char* ptr, int n, int ext){
+  struct ip6_hdr* ip6 = (struct ip6_hdr*)ptr;
+  memset(ip6, 0, sizeof(struct ip6_hdr));
+  ip6->ip6_vfc = 6 << 4;
+  ip6->ip6_hlim = 64;
+  ip6->ip6_src.s6_addr[0] = 0x20;
+  ip6->ip6_src.s6_addr[15] = n;
+  ip6->ip6_dst.s6_addr[0] = 0x20;
+  ip6->ip6_dst.s6_addr[15] = 1;
+  ptr += sizeof(struct ip6_hdr);
+
+  uint8_t* nxt = &ip6->ip6_nxt;
+  for ( int i = 0; i < ext; i++ ){
+    *nxt = i == 0 ? IPPROTO_HOPOPTS : IPPROTO_DSTOPTS;
+    struct ip6_ext* hdr = (struct ip6_ext*)ptr;
+    memset(ptr, 0, 8);
+    nxt = &hdr->ip6e_nxt;
+    ptr += 8;
+  }
+  *nxt = IPPROTO_TCP;
+  return ptr;
+}
+
+static void ipv4_frame(int i, int vlan){
+  struct cap_header* cp = (struct cap_header*)frames[i];
+  char* data = frames[i] + sizeof(struct cap_header);
+  char* end = put_tcp(put_ipv4(put_eth(data, ETHERTYPE_IP, vlan), i, IPPROTO_TCP), i);
+  cp->caplen = cp->len = end - data;
+}
+
+static void ipv6_frame(int i, int ext){
+  struct cap_header* cp = (struct cap_header*)frames[i];
+  char* data = frames[i] + sizeof(struct cap_header);
+  char* end = put_tcp(put_ipv6(put_eth(data, ETHERTYPE_IPV6, 0), i, ext), i);
+  cp->caplen = cp->len = end - data;
+}
+
+static void build_ipv4(int vlan){
+  for ( int i = 0; i < FRAMES; i++ ){
+    ipv4_frame(i, vlan);
+  }
+}
+
+static void build_ipv6(int ext){
+  for ( int i = 0; i < FRAMES; i++ ){
+    ipv6_frame(i, ext);
+  }
+}
+
+/**
+ * IPv4 outer header carrying an IPv4/TCP packet using the given
+ * encapsulation.
+ */
+static void build_tunnel(enum frame_tunnel tunnel){
+  for ( int i = 0; i < FRAMES; i++ ){
+    struct cap_header* cp = (struct cap_header*)frames[i];
+    char* data = frames[i] + sizeof(struct cap_header);
+    char* ptr = put_eth(data, ETHERTYPE_IP, 0);
+
+    switch ( tunnel ){
+    case FRAME_TUNNEL_GRE:
+      ptr = put_gre(put_ipv4(ptr, i, IPPROTO_GRE), ETHERTYPE_IP);
+      break;
+    case FRAME_TUNNEL_VXLAN:
+      ptr = put_vxlan(put_udp(put_ipv4(ptr, i, IPPROTO_UDP), i, 4789), i);
+      ptr = put_eth(ptr, ETHERTYPE_IP, 0);
+      break;
+    case FRAME_TUNNEL_GTPU:
+      ptr = put_gtpu(put_udp(put_ipv4(ptr, i, IPPROTO_UDP), i, 2152), i);
+      break;
+    default:
+      ptr = put_ipv4(ptr, i, IPPROTO_IPIP);
+      break;
+    }
+
+    char* end = put_tcp(put_ipv4(ptr, i, IPPROTO_TCP), i);
+    cp->caplen = cp->len = end - data;
+  }
+}
+
+static int classify_generic(const void* data, size_t caplen, struct frame_info* info){
+  return classify_packet_offsets((const struct cap_header*)((const char*)data - offsetof(struct cap_header, payload)), info);
+}
+
+/**
+ * Time per frame (ns) of classifying the frames with func. Every frame must
+ * be classified as expect.
+ */
+static double measure(const char* name, classify_func func, unsigned long iterations, uint32_t expect){
+  struct frame_info info;
+  uint64_t sum = 0;
+
+  /* warm up and verify */
+  for ( int i = 0; i < FRAMES; i++ ){
+    const struct cap_header* cp = (const struct cap_header*)frames[i];
+    const int ret = func(cp->payload, cp->caplen, &info);
+    if ( ret != CLASSIFY_OK || info.type != expect ){
+      fprintf(stderr, "%s: frame %d classified as 0x%x (%s)\n", name, i, info.type, classify_result_string(ret));
+      exit(1);
+    }
+  }
+
+  const uint64_t begin = now_ns();
+  for ( unsigned long i = 0; i < iterations; i++ ){
+    const struct cap_header* cp = (const struct cap_header*)frames[i % FRAMES];
+    func(cp->payload, cp->caplen, &info);
+    sum += info.l4_offset;
+  }
+  const uint64_t elapsed = now_ns() - begin;
+
+  sink = sum;
+  return (double)elapsed / iterations;
+}
+
+/**
+ * Run one case with classify_packet_offsets() and, if types is set, with
+ * classify_specialized(types), and print the time per frame.
+ */
+static void run(const char* name, unsigned long iterations, uint32_t expect, uint32_t types){
+  const double generic = measure(name, classify_generic, iterations, expect);
+  printf("%-24s %8.2f ns/frame %8.2f Mframes/s", name, generic, 1e3 / generic);
+
+  if ( types ){
+    const double specialized = measure(name, classify_specialized(types), iterations, expect);
+    printf(" %8.2f ns/frame %8.2f Mframes/s", specialized, 1e3 / specialized);
+  }
+
+  putchar('\n');
+}
+
+/* records packed as in the consumer buffer */
+static char slab[FRAMES * (sizeof(struct packet) - MAX_CAPTURE_SIZE + FRAME_SIZE)] __attribute__((aligned(64)));
+static const struct packet* records[FRAMES];
+
+/**
+ * Classified records, alternately IPv4 and IPv6 TCP.
+ */
+static void build_records(void){
+  char* ptr = slab;
+  for ( int i = 0; i < FRAMES; i++ ){
+    if ( i % 2 == 0 ){
+      ipv4_frame(i, 0);
+    } else {
+      ipv6_frame(i, 0);
+    }
+
+    const struct cap_header* cp = (const struct cap_header*)frames[i];
+    struct packet* pkt = (struct packet*)ptr;
+    memcpy(&pkt->caphead, cp, sizeof(struct cap_header) + cp->caplen);
+    classify_packet_offsets(&pkt->caphead, &pkt->info);
+    records[i] = pkt;
+    ptr += ring_record_size(cp->caplen);
+  }
+}
+
+/**
+ * Time per packet of packet_tuples_extract() over batches of 256 records.
+ */
+static void run_tuples(unsigned long iterations, enum tuples_kernel kernel){
+  static const size_t batch = 256;
+  struct packet_tuples t;
+
+  const int ret = packet_tuples_init(&t, batch, kernel);
+  if ( ret != 0 ){
+    printf("%-24s %s\n", packet_tuples_kernel_name(kernel), strerror(ret));
+    return;
+  }
+
+  uint64_t sum = 0;
+  const uint64_t begin = now_ns();
+  for ( unsigned long i = 0; i < iterations; i += batch ){
+    packet_tuples_extract(&t, &records[i % FRAMES], batch);
+    sum += t.src_port[0];
+  }
+  const uint64_t elapsed = now_ns() - begin;
+  const double ns = (double)elapsed / iterations;
+
+  sink = sum;
+  printf("%-24s %8.2f ns/packet %7.2f Mpackets/s\n", packet_tuples_kernel_name(kernel), ns, 1e3 / ns);
+  packet_tuples_free(&t);
+}
+
+typedef void (*hash_func)(const struct packet** pkt, size_t n, uint32_t* hash);
+
+static struct toeplitz toeplitz;
+
+static void hash_crc32c(const struct packet** pkt, size_t n, uint32_t* hash){
+  for ( size_t i = 0; i < n; i++ ){
+    hash[i] = packet_flow_hash(&pkt[i]->caphead, &pkt[i]->info);
+  }
+}
+
+static void hash_toeplitz(const struct packet** pkt, size_t n, uint32_t* hash){
+  for ( size_t i = 0; i < n; i++ ){
+    hash[i] = flow_hash_toeplitz(&toeplitz, pkt[i]->buf, pkt[i]->caphead.caplen, &pkt[i]->info);
+  }
+}
+
+static void hash_toeplitz_bitwise(const struct packet** pkt, size_t n, uint32_t* hash){
+  for ( size_t i = 0; i < n; i++ ){
+    hash[i] = packet_flow_hash_toeplitz(&pkt[i]->caphead, &pkt[i]->info, NULL);
+  }
+}
+
+/**
+ * Time per packet of hashing the records in batches of 256.
+ */
+static void run_hash(const char* name, hash_func func, unsigned long iterations){
+  static const size_t batch = 256;
+  uint32_t hash[batch];
+  uint64_t sum = 0;
+
+  const uint64_t begin = now_ns();
+  for ( unsigned long i = 0; i < iterations; i += batch ){
+    func(&records[i % FRAMES], batch, hash);
+    sum += hash[0];
+  }
+  const uint64_t elapsed = now_ns() - begin;
+  const double ns = (double)elapsed / iterations;
+
+  sink = sum;
+  printf("%-24s %8.2f ns/packet %7.2f Mpackets/s\n", name, ns, 1e3 / ns);
+}
+
+int main(int argc, char* argv[]){
+  unsigned long iterations = 20000000;
+
+  int op, option_index = -1;
+  while ( (op = getopt_long(argc, argv, shortopts, longopts, &option_index)) != -1 ){
+    switch ( op ){
+    case 'n':
+      iterations = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'h':
+      show_usage();
+      return 0;
+
+    default:
+      show_usage();
+      return 1;
+    }
+  }
+
+  if ( iterations == 0 ){
+    fprintf(stderr, "consumer-bench: iterations must be greater than zero\n");
+    return 1;
+  }
+
+  printf("%lu frames per case\n", iterations);
+  printf("%-24s %-35s %s\n", "", "classify_packet_offsets()", "classify_specialized()");
+
+  build_ipv4(0);
+  run("ipv4/tcp", iterations, PACKET_IP | TRANSPORT_TCP, PACKET_IP | TRANSPORT_TCP);
+
+  build_ipv4(100);
+  run("vlan/ipv4/tcp", iterations, PACKET_IP | TRANSPORT_TCP, PACKET_IP | TRANSPORT_TCP);
+
+  build_ipv6(0);
+  run("ipv6/tcp", iterations, PACKET_IPV6 | TRANSPORT_TCP, PACKET_IPV6 | TRANSPORT_TCP);
+
+  build_ipv6(2);
+  run("ipv6/hbh/dst/tcp", iterations, PACKET_IPV6 | TRANSPORT_TCP, PACKET_IPV6 | TRANSPORT_TCP);
+
+  static const enum frame_tunnel tunnels[] = {FRAME_TUNNEL_IPIP, FRAME_TUNNEL_GRE, FRAME_TUNNEL_VXLAN, FRAME_TUNNEL_GTPU};
+  for ( unsigned i = 0; i < sizeof(tunnels) / sizeof(tunnels[0]); i++ ){
+    char name[32];
+    snprintf(name, sizeof(name), "%s/ipv4/tcp", frame_tunnel_name(tunnels[i]));
+    build_tunnel(tunnels[i]);
+    run(name, iterations, PACKET_TUNNEL | PACKET_IP | TRANSPORT_TCP, 0);
+  }
+
+  printf("\npacket_tuples_extract(), %lu packets per kernel\n", iterations);
+  build_records();
+  run_tuples(iterations, TUPLES_SCALAR);
+  run_tuples(iterations, TUPLES_SSE4);
+  run_tuples(iterations, TUPLES_AVX2);
+
+  printf("\nflow hash, %lu packets per case (crc32c: %s)\n", iterations, flow_hash_crc32c_impl());
+  toeplitz_init(&toeplitz, NULL);
+  run_hash("crc32c", hash_crc32c, iterations);
+  run_hash("crc32c batch", packet_flow_hash_batch, iterations);
+  run_hash("toeplitz", hash_toeplitz, iterations);
+  run_hash("toeplitz bitwise", hash_toeplitz_bitwise, iterations);
+
+  return 0;
+}
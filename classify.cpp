@@ -0,0 +1,42 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "classify.hpp"
+
+using namespace classify;
+
+template <class Network>
+static int specialized(const void* data, size_t caplen, struct frame_info* info){
+  return Eth<Vlan<Mpls<Network> > >::parse((const char*)data, caplen, info);
+}
+
+typedef Or<Tcp, Udp> TcpUdp;
+
+/* indexed by transport (any, tcp, udp, both) and network (ipv4, ipv6, both) */
+#define TRANSPORT(T) {specialized<IPv4<T> >, specialized<IPv6<T> >, specialized<Or<IPv4<T>, IPv6<T> > >}
+static const classify_func table[4][3] = {
+  TRANSPORT(Any),
+  TRANSPORT(Tcp),
+  TRANSPORT(Udp),
+  TRANSPORT(TcpUdp),
+};
+#undef TRANSPORT
+
+extern "C" classify_func classify_specialized(uint32_t types){
+  static const uint32_t network = PACKET_IP | PACKET_IPV6;
+  static const uint32_t transport = TRANSPORT_TCP | TRANSPORT_UDP;
+
+  if ( types == 0 || (types & ~(network | transport)) ){
+    return NULL;
+  }
+
+  /* no network protocol means both */
+  if ( !(types & network) ){
+    types |= network;
+  }
+
+  const int n = ((types & network) == network) ? 2 : (types & PACKET_IPV6) ? 1 : 0;
+  const int t = ((types & TRANSPORT_TCP) ? 1 : 0) | ((types & TRANSPORT_UDP) ? 2 : 0);
+  return table[t][n];
+}
@@ -0,0 +1,381 @@
+#ifndef CONSUMER_CLASSIFY_HPP
+#define CONSUMER_CLASSIFY_HPP
+
+/**
+ * Compile-time specialized classifiers. A parser is a stack of layer
+ * templates, each layer only knowing the layers it was given as arguments:
+ *
+ *   typedef classify::Eth<classify::Vlan<classify::IPv4<classify::Udp> > > parser;
+ *   int ret = parser::parse(cp->payload, cp->caplen, &info);
+ *
+ * Alternatives are combined with Or<A, B> and Any ends a stack early. The
+ * whole parser is inlined into the caller and protocols which aren't listed
+ * are never looked at.
+ *
+ * The result is the same struct frame_info (and enum classify_result) as
+ * classify_packet_offsets() gives for the frames the parser accepts. Other
+ * frames stop at the first layer which doesn't match with
+ * CLASSIFY_UNKNOWN_ETHERTYPE or CLASSIFY_UNKNOWN_PROTOCOL. Tunnels are not
+ * decapsulated.
+ *
+ * Layers below Eth implement:
+ *
+ *   static bool match(unsigned int key);
+ *   static enum classify_result parse(const char* data, size_t caplen, size_t offset, unsigned int key, struct frame_info* info);
+ *
+ * where key is the ethertype for network layers and the IP protocol for
+ * transport layers, and offset is where the layer starts. parse() is only
+ * called if match() accepted the key.
+ *
+ * From C use classify_specialized() which has the common stacks instantiated.
+ */
+
+#include "consumer.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+namespace classify {
+
+inline uint16_t load16(const char* ptr){
+  uint16_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return ntohs(value);
+}
+
+/* 802.1Q, 802.1ad and pre-standard service tags */
+inline bool vlan_tag(unsigned int ethertype){
+  return ethertype == 0x8100 || ethertype == 0x88A8 || ethertype == 0x9100;
+}
+
+/* unicast and multicast mpls */
+inline bool mpls_label(unsigned int ethertype){
+  return ethertype == 0x8847 || ethertype == 0x8848;
+}
+
+/**
+ * Ethernet header, the root of a parser.
+ */
+template <class Next>
+struct Eth {
+  /**
+   * Classify the first caplen bytes of the frame at data.
+   *
+   * @return enum classify_result, also stored in info.
+   */
+  static int parse(const char* data, size_t caplen, struct frame_info* info){
+    memset(info, 0, sizeof(struct frame_info));
+    info->result = layer(data, caplen, info);
+    return info->result;
+  }
+
+private:
+  static enum classify_result layer(const char* data, size_t caplen, struct frame_info* info){
+    if ( caplen < sizeof(struct ethhdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+
+    info->ethertype = load16(data + 2*ETH_ALEN);
+    if ( !Next::match(info->ethertype) ){
+      return CLASSIFY_UNKNOWN_ETHERTYPE;
+    }
+
+    return Next::parse(data, caplen, sizeof(struct ethhdr), info->ethertype, info);
+  }
+};
+
+/**
+ * Any number of vlan tags, including none.
+ */
+template <class Next>
+struct Vlan {
+  static bool match(unsigned int ethertype){
+    return vlan_tag(ethertype) || Next::match(ethertype);
+  }
+
+  static enum classify_result parse(const char* data, size_t caplen, size_t offset, unsigned int ethertype, struct frame_info* info){
+    while ( vlan_tag(ethertype) ){
+      if ( caplen < offset + 4 ){
+	return CLASSIFY_TRUNCATED;
+      }
+      if ( info->tags == UINT8_MAX ){
+	return CLASSIFY_UNKNOWN_ETHERTYPE;
+      }
+      ethertype = load16(data + offset + 2);
+      info->tags++;
+      offset += 4;
+    }
+
+    info->ethertype = ethertype;
+    if ( !Next::match(ethertype) ){
+      return CLASSIFY_UNKNOWN_ETHERTYPE;
+    }
+
+    return Next::parse(data, caplen, offset, ethertype, info);
+  }
+};
+
+/**
+ * An optional mpls label stack. The payload is identified by the IP version
+ * following the bottom label.
+ */
+template <class Next>
+struct Mpls {
+  static bool match(unsigned int ethertype){
+    return mpls_label(ethertype) || Next::match(ethertype);
+  }
+
+  static enum classify_result parse(const char* data, size_t caplen, size_t offset, unsigned int ethertype, struct frame_info* info){
+    if ( !mpls_label(ethertype) ){
+      return Next::parse(data, caplen, offset, ethertype, info);
+    }
+
+    uint32_t entry;
+    do {
+      if ( caplen < offset + 4 ){
+	return CLASSIFY_TRUNCATED;
+      }
+      if ( info->labels == UINT8_MAX ){
+	return CLASSIFY_UNKNOWN_ETHERTYPE;
+      }
+      memcpy(&entry, data + offset, sizeof(entry));
+      info->labels++;
+      offset += 4;
+    } while ( !(ntohl(entry) & 0x100) );
+
+    if ( caplen <= offset ){
+      return CLASSIFY_TRUNCATED;
+    }
+    switch ( (uint8_t)data[offset] >> 4 ){
+    case 4:
+      ethertype = ETHERTYPE_IP;
+      break;
+    case 6:
+      ethertype = ETHERTYPE_IPV6;
+      break;
+    default:
+      return CLASSIFY_UNKNOWN_ETHERTYPE;
+    }
+
+    info->ethertype = ethertype;
+    if ( !Next::match(ethertype) ){
+      return CLASSIFY_UNKNOWN_ETHERTYPE;
+    }
+
+    return Next::parse(data, caplen, offset, ethertype, info);
+  }
+};
+
+template <class Next>
+struct IPv4 {
+  static bool match(unsigned int ethertype){
+    return ethertype == ETHERTYPE_IP;
+  }
+
+  static enum classify_result parse(const char* data, size_t caplen, size_t offset, unsigned int, struct frame_info* info){
+    if ( caplen < offset + sizeof(struct ip) ){
+      return CLASSIFY_TRUNCATED;
+    }
+
+    const struct ip* ip = (const struct ip*)(data + offset);
+    info->type |= PACKET_IP;
+    info->proto = ip->ip_p;
+    info->l3_offset = offset;
+
+    /* a header length below the fixed header would put the transport header
+     * inside it */
+    if ( ip->ip_hl < 5 ){
+      return CLASSIFY_TRUNCATED;
+    }
+
+    /* only the first fragment has the transport header */
+    if ( ntohs(ip->ip_off) & IP_OFFMASK ){
+      return CLASSIFY_FRAGMENT;
+    }
+
+    if ( !Next::match(ip->ip_p) ){
+      return CLASSIFY_UNKNOWN_PROTOCOL;
+    }
+
+    return Next::parse(data, caplen, offset + 4*ip->ip_hl, ip->ip_p, info);
+  }
+};
+
+/**
+ * IPv6 header and its extension headers.
+ */
+template <class Next>
+struct IPv6 {
+  static bool match(unsigned int ethertype){
+    return ethertype == ETHERTYPE_IPV6;
+  }
+
+  static enum classify_result parse(const char* data, size_t caplen, size_t offset, unsigned int, struct frame_info* info){
+    if ( caplen < offset + sizeof(struct ip6_hdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+
+    const struct ip6_hdr* ip6 = (const struct ip6_hdr*)(data + offset);
+    info->type |= PACKET_IPV6;
+    info->proto = ip6->ip6_nxt;
+    info->l3_offset = offset;
+    offset += sizeof(struct ip6_hdr);
+
+    for (;;){
+      const struct ip6_ext* ext = (const struct ip6_ext*)(data + offset);
+
+      switch ( info->proto ){
+      case IPPROTO_HOPOPTS:
+      case IPPROTO_ROUTING:
+      case IPPROTO_DSTOPTS:
+	if ( caplen < offset + sizeof(struct ip6_ext) ){
+	  return CLASSIFY_TRUNCATED;
+	}
+	info->proto = ext->ip6e_nxt;
+	offset += 8 * (ext->ip6e_len + 1);
+	break;
+
+      case IPPROTO_AH:
+	if ( caplen < offset + sizeof(struct ip6_ext) ){
+	  return CLASSIFY_TRUNCATED;
+	}
+	info->proto = ext->ip6e_nxt;
+	offset += 4 * (ext->ip6e_len + 2);
+	break;
+
+      case IPPROTO_FRAGMENT:
+	if ( caplen < offset + sizeof(struct ip6_frag) ){
+	  return CLASSIFY_TRUNCATED;
+	}
+	info->proto = ext->ip6e_nxt;
+	if ( ntohs(((const struct ip6_frag*)ext)->ip6f_offlg & IP6F_OFF_MASK) ){
+	  return CLASSIFY_FRAGMENT;
+	}
+	offset += sizeof(struct ip6_frag);
+	break;
+
+      default:
+	if ( !Next::match(info->proto) ){
+	  return CLASSIFY_UNKNOWN_PROTOCOL;
+	}
+	return Next::parse(data, caplen, offset, info->proto, info);
+      }
+    }
+  }
+};
+
+struct Tcp {
+  static bool match(unsigned int proto){
+    return proto == IPPROTO_TCP;
+  }
+
+  static enum classify_result parse(const char* data, size_t caplen, size_t offset, unsigned int, struct frame_info* info){
+    if ( caplen < offset + sizeof(struct tcphdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= TRANSPORT_TCP;
+    info->l4_offset = offset;
+    offset += 4*((const struct tcphdr*)(data + offset))->doff;
+    info->payload_offset = offset < caplen ? offset : caplen;
+    return CLASSIFY_OK;
+  }
+};
+
+struct Udp {
+  static bool match(unsigned int proto){
+    return proto == IPPROTO_UDP;
+  }
+
+  static enum classify_result parse(const char*, size_t caplen, size_t offset, unsigned int, struct frame_info* info){
+    if ( caplen < offset + sizeof(struct udphdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= TRANSPORT_UDP;
+    info->l4_offset = offset;
+    info->payload_offset = offset + sizeof(struct udphdr);
+    return CLASSIFY_OK;
+  }
+};
+
+/**
+ * ICMP, only accepted under IPv4.
+ */
+struct Icmp {
+  static bool match(unsigned int proto){
+    return proto == IPPROTO_ICMP;
+  }
+
+  static enum classify_result parse(const char*, size_t caplen, size_t offset, unsigned int, struct frame_info* info){
+    if ( !(info->type & PACKET_IP) ){
+      return CLASSIFY_UNKNOWN_PROTOCOL;
+    }
+    if ( caplen < offset + sizeof(struct icmphdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= PACKET_ICMP;
+    info->l4_offset = offset;
+    return CLASSIFY_OK;
+  }
+};
+
+/**
+ * ICMPv6, only accepted under IPv6.
+ */
+struct Icmp6 {
+  static bool match(unsigned int proto){
+    return proto == IPPROTO_ICMPV6;
+  }
+
+  static enum classify_result parse(const char*, size_t caplen, size_t offset, unsigned int, struct frame_info* info){
+    if ( !(info->type & PACKET_IPV6) ){
+      return CLASSIFY_UNKNOWN_PROTOCOL;
+    }
+    if ( caplen < offset + sizeof(struct icmp6_hdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= PACKET_ICMP;
+    info->l4_offset = offset;
+    return CLASSIFY_OK;
+  }
+};
+
+/**
+ * Accepts whatever follows without looking at it, e.g. IPv4<Any> for every
+ * IPv4 packet regardless of protocol.
+ */
+struct Any {
+  static bool match(unsigned int){
+    return true;
+  }
+
+  static enum classify_result parse(const char*, size_t, size_t, unsigned int, struct frame_info*){
+    return CLASSIFY_OK;
+  }
+};
+
+/**
+ * Either of two layers, A is preferred if both match.
+ */
+template <class A, class B>
+struct Or {
+  static bool match(unsigned int key){
+    return A::match(key) || B::match(key);
+  }
+
+  static enum classify_result parse(const char* data, size_t caplen, size_t offset, unsigned int key, struct frame_info* info){
+    if ( A::match(key) ){
+      return A::parse(data, caplen, offset, key, info);
+    }
+    return B::parse(data, caplen, offset, key, info);
+  }
+};
+
+} /* namespace classify */
+
+#endif /* CONSUMER_CLASSIFY_HPP */
@@ -119,7 +119,7 @@ static PyObject* consumer_poll(Consumer* self, PyObject* args, PyObject* kwargs)
   Py_BEGIN_ALLOW_THREADS;
   {
     memset(&pw->vlan_tci, 0, sizeof(packet_wrapper) - sizeof(struct packet)); /* reset all fields, but leave actual packet data alone (for performance) */
-    result = consumer_thread_poll(self->thread, &pw->pkt, ms);
+    result = consumer_thread_poll(self->thread, &pw->pkt, ms); /* copies only the captured bytes */
   }
   Py_END_ALLOW_THREADS;
 
@@ -3,31 +3,56 @@
 #endif
 
 #include "consumer.h"
+#include "ring.h"
+#include "spill.h"
+#include "flowhash.h"
+#include "reasm.h"
 
 #include <stdlib.h>
 #include <stddef.h> /* offsetof */
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <sched.h>
 #include <net/if_arp.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <time.h>
-#include <semaphore.h>
+#include <sys/time.h>
 
 #define STPBRIDGES 0x0026
 #define CDPVTP 0x016E
 #define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88A8      /* 802.1ad service tag */
+#define ETHERTYPE_QINQ_OLD 0x9100  /* pre-standard service tag */
+#define ETHERTYPE_MPLS 0x8847
+#define ETHERTYPE_MPLS_MCAST 0x8848
 
-static void hexdump(FILE* fp, const char* data, size_t size);
+#define ETHERTYPE_TEB 0x6558     /* transparent ethernet bridging (GRE) */
 
-struct vlan_proto {
-  u_int16_t type; /* Encoded VLAN */
-};
+#define VLAN_TAG_SIZE 4   /* tag control information and the next ethertype */
+#define MPLS_ENTRY_SIZE 4
+#define MPLS_BOS 0x100    /* bottom of stack bit of a label stack entry */
+
+#define GRE_CSUM 0x8000   /* optional fields present in a GRE header */
+#define GRE_ROUTING 0x4000
+#define GRE_KEY 0x2000
+#define GRE_SEQ 0x1000
+#define GRE_VERSION 0x0007
+
+#define VXLAN_PORT 4789
+#define VXLAN_FLAG_VNI 0x08
+#define GTPU_PORT 2152
+#define GTPU_GPDU 0xFF    /* message type of a G-PDU (user data) */
+
+static void hexdump(FILE* fp, const char* data, size_t size);
 
 struct my_arpreq {
   unsigned char arp_sha[ETH_ALEN];      /* Sender hardware address.  */
@@ -36,102 +61,660 @@ struct my_arpreq {
   unsigned char arp_tip[4];             /* Target IP address.  */
 };
 
-int classify_packet(struct cap_header* cp, struct frame_t* frame){
-  assert(cp);
-  assert(frame);
+/**
+ * Classify the transport header at offset, shared by IPv4 and IPv6.
+ */
+static enum classify_result classify_transport(const char* data, size_t caplen, size_t offset, struct frame_info* info){
+  switch ( info->proto ){
+  case IPPROTO_TCP:
+    if ( caplen < offset + sizeof(struct tcphdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= TRANSPORT_TCP;
+    info->l4_offset = offset;
+    offset += 4*((const struct tcphdr*)(data + offset))->doff;
+    info->payload_offset = offset < caplen ? offset : caplen;
+    return CLASSIFY_OK;
 
-  memset(frame, 0, sizeof(struct frame_t));
+  case IPPROTO_UDP:
+    if ( caplen < offset + sizeof(struct udphdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= TRANSPORT_UDP;
+    info->l4_offset = offset;
+    info->payload_offset = offset + sizeof(struct udphdr);
+    return CLASSIFY_OK;
 
-  char* ptr = (char*)cp;
-  frame->type = 0;
-  frame->eth = (struct ethhdr*)cp->payload;
-  frame->frame_size = cp->len;
-  frame->payload_size = cp->caplen;
+  case IPPROTO_ICMP:
+    if ( !(info->type & PACKET_IP) ){
+      return CLASSIFY_UNKNOWN_PROTOCOL;
+    }
+    if ( caplen < offset + sizeof(struct icmphdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= PACKET_ICMP;
+    info->l4_offset = offset;
+    return CLASSIFY_OK;
 
-  /* offset from capture header to start of ethernet frame payload */
-  size_t ethernet_offset = sizeof(cap_head) + sizeof(struct ethhdr);
-  
-  switch ( ntohs(frame->eth->h_proto) ){
-  case ETHERTYPE_VLAN:
-    frame->vlan = (struct ether_vlan_header*)frame->eth;
-    {
-      size_t vlan_offset = sizeof(struct cap_header) + sizeof(struct ether_vlan_header);
-      struct vlan_proto* vlanPROTO = (struct vlan_proto*)(ptr + vlan_offset);
-      fprintf(stdout, "802.1Q vlan# %d: ", 0x0FFF&ntohs(frame->vlan->vlan_tci));
-      
-      if( ntohs(vlanPROTO->type) != ETHERTYPE_IP ){
-	fprintf(stderr, ": Encapsulation type [%0x] ", ntohs(vlanPROTO->type));
-	fprintf(stderr, "Not a IP .\n");
-	return 1;
+  case IPPROTO_ICMPV6:
+    if ( !(info->type & PACKET_IPV6) ){
+      return CLASSIFY_UNKNOWN_PROTOCOL;
+    }
+    if ( caplen < offset + sizeof(struct icmp6_hdr) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= PACKET_ICMP;
+    info->l4_offset = offset;
+    return CLASSIFY_OK;
+
+  default:
+    return CLASSIFY_UNKNOWN_PROTOCOL;
+  }
+}
+
+/**
+ * Classify the IPv4 header at offset and what follows it. offset is moved to
+ * the transport header.
+ */
+static enum classify_result classify_ipv4(const char* data, size_t caplen, size_t* offset, struct frame_info* info){
+  if ( caplen < *offset + sizeof(struct ip) ){
+    return CLASSIFY_TRUNCATED;
+  }
+
+  const struct ip* ip = (const struct ip*)(data + *offset);
+  info->type |= PACKET_IP;
+  info->proto = ip->ip_p;
+  info->l3_offset = *offset;
+
+  /* a header length below the fixed header would put the transport header
+   * inside it */
+  if ( ip->ip_hl < 5 ){
+    return CLASSIFY_TRUNCATED;
+  }
+
+  /* only the first fragment has the transport header */
+  if ( ntohs(ip->ip_off) & IP_OFFMASK ){
+    return CLASSIFY_FRAGMENT;
+  }
+
+  *offset += 4*ip->ip_hl;
+  return classify_transport(data, caplen, *offset, info);
+}
+
+/**
+ * Walk the IPv6 extension headers to the transport header, where offset is
+ * left. Each header is at least 8 bytes so the walk is bounded by caplen.
+ */
+static enum classify_result classify_ipv6(const char* data, size_t caplen, size_t* offset_ptr, struct frame_info* info){
+  size_t offset = *offset_ptr;
+  if ( caplen < offset + sizeof(struct ip6_hdr) ){
+    return CLASSIFY_TRUNCATED;
+  }
+
+  const struct ip6_hdr* ip6 = (const struct ip6_hdr*)(data + offset);
+  info->type |= PACKET_IPV6;
+  info->proto = ip6->ip6_nxt;
+  info->l3_offset = offset;
+  offset += sizeof(struct ip6_hdr);
+
+  for (;;){
+    const struct ip6_ext* ext = (const struct ip6_ext*)(data + offset);
+
+    switch ( info->proto ){
+    case IPPROTO_HOPOPTS:
+    case IPPROTO_ROUTING:
+    case IPPROTO_DSTOPTS:
+      if ( caplen < offset + sizeof(struct ip6_ext) ){
+	return CLASSIFY_TRUNCATED;
+      }
+      info->proto = ext->ip6e_nxt;
+      offset += 8 * (ext->ip6e_len + 1);
+      break;
+
+    case IPPROTO_AH:
+      if ( caplen < offset + sizeof(struct ip6_ext) ){
+	return CLASSIFY_TRUNCATED;
+      }
+      info->proto = ext->ip6e_nxt;
+      offset += 4 * (ext->ip6e_len + 2);
+      break;
+
+    case IPPROTO_FRAGMENT:
+      if ( caplen < offset + sizeof(struct ip6_frag) ){
+	return CLASSIFY_TRUNCATED;
+      }
+      info->proto = ext->ip6e_nxt;
+      if ( ntohs(((const struct ip6_frag*)ext)->ip6f_offlg & IP6F_OFF_MASK) ){
+	return CLASSIFY_FRAGMENT;
+      }
+      offset += sizeof(struct ip6_frag);
+      break;
+
+    default:
+      *offset_ptr = offset;
+      return classify_transport(data, caplen, offset, info);
+    }
+  }
+}
+
+/**
+ * Strip the vlan tags (any number, 802.1Q and 802.1ad) and the MPLS label
+ * stack from the frame at data. On success offset is set to the start of the
+ * layer 3 header and info->ethertype to its type. The payload of an MPLS
+ * stack is identified by the IP version following the bottom label.
+ */
+static enum classify_result classify_l2(const char* data, size_t caplen, size_t* offset, struct frame_info* info){
+  size_t pos = sizeof(struct ethhdr);
+  if ( caplen < pos ){
+    return CLASSIFY_TRUNCATED;
+  }
+
+  info->ethertype = ntohs(((const struct ethhdr*)data)->h_proto);
+
+  while ( info->ethertype == ETHERTYPE_VLAN || info->ethertype == ETHERTYPE_QINQ || info->ethertype == ETHERTYPE_QINQ_OLD ){
+    if ( caplen < pos + VLAN_TAG_SIZE ){
+      return CLASSIFY_TRUNCATED;
+    }
+    if ( info->tags == UINT8_MAX ){
+      return CLASSIFY_UNKNOWN_ETHERTYPE;
+    }
+    uint16_t next;
+    memcpy(&next, data + pos + 2, sizeof(next));
+    info->ethertype = ntohs(next);
+    info->tags++;
+    pos += VLAN_TAG_SIZE;
+  }
+
+  if ( info->ethertype == ETHERTYPE_MPLS || info->ethertype == ETHERTYPE_MPLS_MCAST ){
+    uint32_t entry;
+    do {
+      if ( caplen < pos + MPLS_ENTRY_SIZE ){
+	return CLASSIFY_TRUNCATED;
       }
+      if ( info->labels == UINT8_MAX ){
+	return CLASSIFY_UNKNOWN_ETHERTYPE;
+      }
+      memcpy(&entry, data + pos, sizeof(entry));
+      info->labels++;
+      pos += MPLS_ENTRY_SIZE;
+    } while ( !(ntohl(entry) & MPLS_BOS) );
 
-      frame->type |= PACKET_IP;
-      frame->ip = (struct ip*)(ptr + vlan_offset + sizeof(struct vlan_proto));
+    if ( caplen <= pos ){
+      return CLASSIFY_TRUNCATED;
+    }
+    switch ( (uint8_t)data[pos] >> 4 ){
+    case 4:
+      info->ethertype = ETHERTYPE_IP;
+      break;
+    case 6:
+      info->ethertype = ETHERTYPE_IPV6;
+      break;
+    default:
+      return CLASSIFY_UNKNOWN_ETHERTYPE; /* e.g. an ethernet pseudowire */
     }
-    /* fallthrough */
+  }
+
+  *offset = pos;
+  return CLASSIFY_OK;
+}
 
+/**
+ * Classify the layer 3 header at offset and what follows it. offset is moved
+ * to the transport header.
+ */
+static enum classify_result classify_l3(const char* data, size_t caplen, size_t* offset, uint16_t ethertype, struct frame_info* info){
+  switch ( ethertype ){
   case ETHERTYPE_IP:
-    if ( !frame->ip ){ /* may be set by ETHERTYPE_VLAN */
-      frame->type |= PACKET_IP;
-      frame->ip = (struct ip*)(ptr + ethernet_offset);
+    return classify_ipv4(data, caplen, offset, info);
+
+  case ETHERTYPE_IPV6:
+    return classify_ipv6(data, caplen, offset, info);
+
+  case ETHERTYPE_ARP:
+    if ( caplen < *offset + sizeof(struct arphdr) + sizeof(struct my_arpreq) ){
+      return CLASSIFY_TRUNCATED;
+    }
+    info->type |= PACKET_ARP;
+    info->l3_offset = *offset;
+    info->l4_offset = *offset + sizeof(struct arphdr);
+    return CLASSIFY_OK;
+
+  default:
+    return CLASSIFY_UNKNOWN_ETHERTYPE;
+  }
+}
+
+/**
+ * Skip an inner ethernet header (and its vlan tags) at offset.
+ */
+static enum classify_result classify_inner_eth(const char* data, size_t caplen, size_t* offset, uint16_t* ethertype){
+  size_t pos = *offset + sizeof(struct ethhdr);
+  uint16_t next;
+
+  if ( caplen < pos ){
+    return CLASSIFY_TRUNCATED;
+  }
+  memcpy(&next, data + pos - 2, sizeof(next));
+  *ethertype = ntohs(next);
+
+  while ( *ethertype == ETHERTYPE_VLAN || *ethertype == ETHERTYPE_QINQ || *ethertype == ETHERTYPE_QINQ_OLD ){
+    if ( caplen < pos + VLAN_TAG_SIZE ){
+      return CLASSIFY_TRUNCATED;
     }
+    memcpy(&next, data + pos + 2, sizeof(next));
+    *ethertype = ntohs(next);
+    pos += VLAN_TAG_SIZE;
+  }
+
+  *offset = pos;
+  return CLASSIFY_OK;
+}
+
+/**
+ * Recognize a tunnel in the layer just classified, offset is where its
+ * transport header starts. If there is a tunnel, tunnel is set and offset and
+ * ethertype are moved to the inner layer 3 header.
+ */
+static enum classify_result classify_tunnel(const char* data, size_t caplen, size_t* offset, uint16_t* ethertype, const struct frame_info* info, enum frame_tunnel* tunnel){
+  size_t pos = *offset;
+  *tunnel = FRAME_TUNNEL_NONE;
+
+  switch ( info->proto ){
+  case IPPROTO_IPIP:
+    *ethertype = ETHERTYPE_IP;
+    *tunnel = FRAME_TUNNEL_IPIP;
+    return CLASSIFY_OK;
+
+  case IPPROTO_IPV6:
+    *ethertype = ETHERTYPE_IPV6;
+    *tunnel = FRAME_TUNNEL_IPIP;
+    return CLASSIFY_OK;
+
+  case IPPROTO_GRE:
     {
-      /* offset from capture header to ip payload */
-      size_t ip_offset = ethernet_offset + 4*frame->ip->ip_hl;
-
-      switch( frame->ip->ip_p) {
-      case IPPROTO_TCP:
-	frame->type |= TRANSPORT_TCP;
-	frame->tcp = (struct tcphdr*)(ptr + ip_offset);
-	frame->payload = (void*)frame->tcp + sizeof(struct tcphdr);
-	return 0;
+      uint16_t hdr[2]; /* flags and version, protocol type */
+      if ( caplen < pos + sizeof(hdr) ){
+	return CLASSIFY_TRUNCATED;
+      }
+      memcpy(hdr, data + pos, sizeof(hdr));
+      const uint16_t flags = ntohs(hdr[0]);
 
-      case IPPROTO_UDP:
-	frame->type |= TRANSPORT_UDP;
-	frame->udp = (struct udphdr*)(ptr + ip_offset);
-	frame->payload = (void*)frame->udp + sizeof(struct udphdr);
-	return 0;
+      /* source routed and enhanced (PPTP) GRE are left alone */
+      if ( flags & (GRE_ROUTING | GRE_VERSION) ){
+	return CLASSIFY_OK;
+      }
 
-      case IPPROTO_ICMP:
-	frame->type |= PACKET_ICMP;
-	frame->icmp = (struct icmphdr*)(ptr + ip_offset);
-	frame->payload = NULL;
-	return 0;
+      pos += sizeof(hdr) + 4 * (!!(flags & GRE_CSUM) + !!(flags & GRE_KEY) + !!(flags & GRE_SEQ));
+      *ethertype = ntohs(hdr[1]);
+      *tunnel = FRAME_TUNNEL_GRE;
+    }
+    break;
+
+  case IPPROTO_UDP:
+    if ( !(info->type & TRANSPORT_UDP) ){
+      return CLASSIFY_OK;
+    }
+    pos = info->l4_offset + sizeof(struct udphdr);
+
+    switch ( ntohs(((const struct udphdr*)(data + info->l4_offset))->dest) ){
+    case VXLAN_PORT:
+      if ( caplen < pos + 8 ){
+	return CLASSIFY_TRUNCATED;
+      }
+      if ( !(data[pos] & VXLAN_FLAG_VNI) ){
+	return CLASSIFY_OK;
+      }
+      pos += 8;
+      *ethertype = ETHERTYPE_TEB;
+      *tunnel = FRAME_TUNNEL_VXLAN;
+      break;
+
+    case GTPU_PORT:
+      {
+	if ( caplen < pos + 8 ){
+	  return CLASSIFY_TRUNCATED;
+	}
+
+	/* only user data of GTPv1 (not GTP') carries packets */
+	const uint8_t flags = data[pos];
+	if ( (flags >> 5) != 1 || !(flags & 0x10) || (uint8_t)data[pos + 1] != GTPU_GPDU ){
+	  return CLASSIFY_OK;
+	}
+	pos += 8;
+
+	/* sequence number, N-PDU number and next extension header type are
+	 * present if any of the E, S and PN flags are set */
+	if ( flags & 0x07 ){
+	  if ( caplen < pos + 4 ){
+	    return CLASSIFY_TRUNCATED;
+	  }
+	  uint8_t next = (flags & 0x04) ? data[pos + 3] : 0;
+	  pos += 4;
+
+	  /* extension headers: length in 4 byte units, next type in the last byte */
+	  while ( next ){
+	    if ( caplen <= pos ){
+	      return CLASSIFY_TRUNCATED;
+	    }
+	    const size_t len = 4 * (uint8_t)data[pos];
+	    if ( len == 0 ){
+	      return CLASSIFY_OK;
+	    }
+	    if ( caplen < pos + len ){
+	      return CLASSIFY_TRUNCATED;
+	    }
+	    next = data[pos + len - 1];
+	    pos += len;
+	  }
+	}
 
-      default:
-	fprintf(stdout, "Unknown transport protocol: %d \n", frame->ip->ip_p);
-	return 1;
+	if ( caplen <= pos ){
+	  return CLASSIFY_TRUNCATED;
+	}
+	switch ( (uint8_t)data[pos] >> 4 ){
+	case 4:
+	  *ethertype = ETHERTYPE_IP;
+	  break;
+	case 6:
+	  *ethertype = ETHERTYPE_IPV6;
+	  break;
+	default:
+	  return CLASSIFY_OK;
+	}
+	*tunnel = FRAME_TUNNEL_GTPU;
       }
+      break;
+
+    default:
+      return CLASSIFY_OK;
     }
     break;
 
-  case ETHERTYPE_IPV6:
-    fprintf(stdout, "IPv6\n");
-    return 1;
-   
-  case ETHERTYPE_ARP:
-    frame->type |= PACKET_ARP;
-    frame->arp.header = (struct arphdr*)(ptr + ethernet_offset);
-    frame->arp.req = (struct my_arpreq*)(ptr + ethernet_offset + sizeof(struct arphdr));
-    return 0;
+  default:
+    return CLASSIFY_OK;
+  }
+
+  if ( *ethertype == ETHERTYPE_TEB ){
+    const enum classify_result ret = classify_inner_eth(data, caplen, &pos, ethertype);
+    if ( ret != CLASSIFY_OK ){
+      *tunnel = FRAME_TUNNEL_NONE;
+      return ret;
+    }
+  }
+
+  *offset = pos;
+  return CLASSIFY_OK;
+}
+
+/**
+ * Classify the first caplen bytes of the frame at data, decapsulating at most
+ * depth tunnels. Headers are only recorded if they are fully inside caplen.
+ */
+static enum classify_result classify_layers(const char* data, size_t caplen, struct frame_info* info, unsigned int depth){
+  size_t offset;
+  enum classify_result ret = classify_l2(data, caplen, &offset, info);
+  if ( ret != CLASSIFY_OK ){
+    return ret;
+  }
+
+  uint16_t ethertype = info->ethertype;
+  for (;;){
+    ret = classify_l3(data, caplen, &offset, ethertype, info);
+    if ( info->depth >= depth || (ret != CLASSIFY_OK && ret != CLASSIFY_UNKNOWN_PROTOCOL) ){
+      return ret;
+    }
+
+    const size_t transport = offset;
+    enum frame_tunnel tunnel;
+    const enum classify_result tunnel_ret = classify_tunnel(data, caplen, &offset, &ethertype, info, &tunnel);
+    if ( tunnel_ret != CLASSIFY_OK ){
+      return tunnel_ret;
+    }
+    if ( tunnel == FRAME_TUNNEL_NONE ){
+      return ret;
+    }
+
+    /* the outermost layers are kept, the inner layers replace the rest */
+    if ( info->depth++ == 0 ){
+      info->tunnel = tunnel;
+      info->outer_l3_offset = info->l3_offset;
+      info->outer_l4_offset = tunnel == FRAME_TUNNEL_IPIP ? 0 : transport;
+    }
+    info->type = PACKET_TUNNEL;
+    info->proto = 0;
+    info->l3_offset = 0;
+    info->l4_offset = 0;
+    info->payload_offset = 0;
+  }
+}
+
+static enum classify_result classify_frame(const char* data, size_t caplen, struct frame_info* info, unsigned int depth){
+  memset(info, 0, sizeof(struct frame_info));
+  if ( depth > UINT8_MAX ){
+    depth = UINT8_MAX;
+  }
+  info->result = classify_layers(data, caplen, info, depth);
+  return info->result;
+}
+
+static enum classify_ethertype ethertype_index(uint16_t ethertype){
+  switch ( ethertype ){
+  case ETHERTYPE_IP:   return CLASSIFY_ETH_IP;
+  case ETHERTYPE_IPV6: return CLASSIFY_ETH_IPV6;
+  case ETHERTYPE_ARP:  return CLASSIFY_ETH_ARP;
+  case 0x0810:         return CLASSIFY_ETH_MP;
+  case STPBRIDGES:     return CLASSIFY_ETH_STP;
+  case CDPVTP:         return CLASSIFY_ETH_CDP;
+  case ETHERTYPE_MPLS:
+  case ETHERTYPE_MPLS_MCAST:
+		       return CLASSIFY_ETH_MPLS;
+  default:             return CLASSIFY_ETH_OTHER;
+  }
+}
+
+/**
+ * Count a classified packet. There is a single writer per stats (the thread
+ * reading the stream) so the counters are bumped without a locked add.
+ */
+static void classify_count(struct classify_stats* stats, const struct frame_info* info){
+#define bump(x) __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+  bump(stats->result[info->result]);
+  if ( info->result != CLASSIFY_TRUNCATED || info->ethertype ){
+    bump(stats->ethertype[ethertype_index(info->ethertype)]);
+  }
+  if ( info->tags ){
+    bump(stats->vlan);
+  }
+  if ( info->labels ){
+    bump(stats->mpls);
+  }
+  if ( info->type & (PACKET_IP | PACKET_IPV6) ){
+    bump(stats->ip_proto[info->proto]);
+  }
+  bump(stats->tunnel[info->tunnel]);
+#undef bump
+}
+
+static void classify_stats_add(struct classify_stats* dst, const struct classify_stats* src){
+  for ( int i = 0; i < CLASSIFY_RESULT_MAX; i++ ){
+    dst->result[i] += __atomic_load_n(&src->result[i], __ATOMIC_RELAXED);
+  }
+  for ( int i = 0; i < CLASSIFY_ETH_MAX; i++ ){
+    dst->ethertype[i] += __atomic_load_n(&src->ethertype[i], __ATOMIC_RELAXED);
+  }
+  dst->vlan += __atomic_load_n(&src->vlan, __ATOMIC_RELAXED);
+  dst->mpls += __atomic_load_n(&src->mpls, __ATOMIC_RELAXED);
+  for ( int i = 0; i < FRAME_TUNNEL_MAX; i++ ){
+    dst->tunnel[i] += __atomic_load_n(&src->tunnel[i], __ATOMIC_RELAXED);
+  }
+  for ( int i = 0; i < 256; i++ ){
+    dst->ip_proto[i] += __atomic_load_n(&src->ip_proto[i], __ATOMIC_RELAXED);
+  }
+}
+
+const char* classify_result_string(int result){
+  switch ( result ){
+  case CLASSIFY_OK:                return "ok";
+  case CLASSIFY_TRUNCATED:         return "truncated";
+  case CLASSIFY_UNKNOWN_ETHERTYPE: return "unknown ethertype";
+  case CLASSIFY_UNKNOWN_PROTOCOL:  return "unknown ip protocol";
+  case CLASSIFY_FRAGMENT:          return "ip fragment";
+  default:                         return "invalid result";
+  }
+}
+
+const char* frame_tunnel_name(int tunnel){
+  switch ( tunnel ){
+  case FRAME_TUNNEL_NONE:  return "none";
+  case FRAME_TUNNEL_GRE:   return "GRE";
+  case FRAME_TUNNEL_VXLAN: return "VXLAN";
+  case FRAME_TUNNEL_GTPU:  return "GTP-U";
+  case FRAME_TUNNEL_IPIP:  return "IP-in-IP";
+  default:                 return "invalid tunnel";
+  }
+}
+
+int classify_packet_offsets(const struct cap_header* cp, struct frame_info* info){
+  return classify_packet_depth(cp, info, CLASSIFY_TUNNEL_DEPTH);
+}
+
+int classify_packet_depth(const struct cap_header* cp, struct frame_info* info, unsigned int depth){
+  assert(cp);
+  assert(info);
+  return classify_frame(cp->payload, cp->caplen, info, depth);
+}
+
+void frame_from_info(struct cap_header* cp, const struct frame_info* info, struct frame_t* frame){
+  assert(cp);
+  assert(info);
+  assert(frame);
+
+  memset(frame, 0, sizeof(struct frame_t));
+
+  const char* data = cp->payload;
+  frame->type = info->type;
+  frame->eth = (struct ethhdr*)data;
+  frame->frame_size = cp->len;
+  frame->payload_size = cp->caplen;
+
+  if ( info->tags ){
+    frame->vlan = (struct ether_vlan_header*)data;
+  }
+
+  if ( info->type & (PACKET_IP | PACKET_IPV6) ){
+    if ( info->type & PACKET_IP ){
+      frame->ip = (struct ip*)(data + info->l3_offset);
+    } else {
+      frame->ip6 = (struct ip6_hdr*)(data + info->l3_offset);
+    }
+    if ( info->l4_offset ){
+      frame->tcp = (struct tcphdr*)(data + info->l4_offset); /* same pointer for udp and icmp */
+    }
+    if ( info->payload_offset ){
+      frame->payload = (char*)data + info->payload_offset;
+    }
+  } else if ( info->type & PACKET_ARP ){
+    frame->arp.header = (struct arphdr*)(data + info->l3_offset);
+    frame->arp.req = (struct my_arpreq*)(data + info->l4_offset);
+  }
+
+  if ( info->tunnel != FRAME_TUNNEL_NONE ){
+    frame->outer.tunnel = info->tunnel;
+    frame->outer.depth = info->depth;
+    if ( (data[info->outer_l3_offset] >> 4) == 4 ){
+      frame->outer.ip = (struct ip*)(data + info->outer_l3_offset);
+    } else {
+      frame->outer.ip6 = (struct ip6_hdr*)(data + info->outer_l3_offset);
+    }
+    if ( info->tunnel == FRAME_TUNNEL_VXLAN || info->tunnel == FRAME_TUNNEL_GTPU ){
+      frame->outer.udp = (struct udphdr*)(data + info->outer_l4_offset);
+    }
+  }
+}
+
+uint16_t frame_vlan_tci(const struct cap_header* cp, const struct frame_info* info, unsigned int index){
+  assert(index < info->tags);
+  uint16_t tci;
+  memcpy(&tci, cp->payload + sizeof(struct ethhdr) + VLAN_TAG_SIZE * index, sizeof(tci));
+  return ntohs(tci);
+}
+
+uint32_t frame_mpls_label(const struct cap_header* cp, const struct frame_info* info, unsigned int index){
+  assert(index < info->labels);
+  uint32_t entry;
+  memcpy(&entry, cp->payload + sizeof(struct ethhdr) + VLAN_TAG_SIZE * info->tags + MPLS_ENTRY_SIZE * index, sizeof(entry));
+  return ntohl(entry) >> 12;
+}
+
+int classify_packet(struct cap_header* cp, struct frame_t* frame){
+  assert(cp);
+  assert(frame);
+
+  struct frame_info info;
+  const int ret = classify_packet_offsets(cp, &info);
+  frame_from_info(cp, &info, frame);
+  return ret;
+}
+
+int classify_packet_verbose(FILE* dst, struct cap_header* cp, struct frame_t* frame){
+  assert(dst);
+  assert(cp);
+  assert(frame);
+
+  struct frame_info info;
+  const int ret = classify_packet_offsets(cp, &info);
+  frame_from_info(cp, &info, frame);
+
+  for ( unsigned int i = 0; i < info.tags; i++ ){
+    fprintf(dst, "802.1Q vlan# %d: ", 0x0FFF & frame_vlan_tci(cp, &info, i));
+  }
+  for ( unsigned int i = 0; i < info.labels; i++ ){
+    fprintf(dst, "MPLS label# %u: ", frame_mpls_label(cp, &info, i));
+  }
+  if ( info.tunnel != FRAME_TUNNEL_NONE ){
+    fprintf(dst, "%s tunnel (depth %d): ", frame_tunnel_name(info.tunnel), info.depth);
+  }
+
+  switch ( ret ){
+  case CLASSIFY_OK:
+    if ( info.tags || info.labels || info.tunnel != FRAME_TUNNEL_NONE ){
+      fputc('\n', dst);
+    }
+    return ret;
+
+  case CLASSIFY_TRUNCATED:
+    fprintf(dst, "Truncated frame (caplen %u)\n", cp->caplen);
+    return ret;
+
+  case CLASSIFY_UNKNOWN_PROTOCOL:
+    fprintf(dst, "Unknown transport protocol: %d \n", info.proto);
+    return ret;
+
+  case CLASSIFY_FRAGMENT:
+    fprintf(dst, "Fragment (protocol %d)\n", info.proto);
+    return ret;
+  }
 
+  switch ( info.ethertype ){
   case 0x0810:
-    fprintf(stdout, "MP packet\n");
-    return 1;
+    fprintf(dst, "MP packet\n");
+    break;
 
   case STPBRIDGES:
-    fprintf(stdout, "STP(0x%x): (spanning-tree for bridges)\n",ntohs(frame->eth->h_proto));
-    return 1;
+    fprintf(dst, "STP(0x%x): (spanning-tree for bridges)\n", info.ethertype);
+    break;
 
   case CDPVTP:
-    fprintf(stdout, "CDP(0x%x): (CISCO Discovery Protocol)\n",ntohs(frame->eth->h_proto));
-    return 1;
+    fprintf(dst, "CDP(0x%x): (CISCO Discovery Protocol)\n", info.ethertype);
+    break;
 
   default:
-    fprintf(stdout, "Unknown ethernet protocol (0x%x)\n", ntohs(frame->eth->h_proto));
-    hexdump(stdout, cp->payload, cp->caplen);
-    return 1;
+    fprintf(dst, "Unknown ethernet protocol (0x%x)\n", info.ethertype);
+    hexdump(dst, cp->payload, cp->caplen);
+    break;
   }
+
+  return ret;
 }
 
 void print_frame_ip(FILE* dst, const struct frame_t* frame){
@@ -193,35 +776,101 @@ void print_frame_ip(FILE* dst, const struct frame_t* frame){
   }
 }
 
-void print_frame_arp(FILE* dst, const struct frame_t* frame){
-  fprintf(dst, "ARP (HDR[%zd]):", sizeof(struct my_arpreq) + sizeof(struct arphdr));
+void print_frame_ip6(FILE* dst, const struct frame_t* frame){
+  char src[INET6_ADDRSTRLEN];
+  char dst_addr[INET6_ADDRSTRLEN];
+  inet_ntop(AF_INET6, &frame->ip6->ip6_src, src, sizeof(src));
+  inet_ntop(AF_INET6, &frame->ip6->ip6_dst, dst_addr, sizeof(dst_addr));
 
-  if(ntohs(frame->arp.header->ar_op)==ARPOP_REQUEST ) {
-    fprintf(dst, "Request: %02d.%02d.%02d.%02d tell ",
-	    frame->arp.req->arp_tip[0], frame->arp.req->arp_tip[1], frame->arp.req->arp_tip[2], frame->arp.req->arp_tip[3]);
-    fprintf(dst, "%02d.%02d.%02d.%02d ",
-	    frame->arp.req->arp_sip[0], frame->arp.req->arp_sip[1], frame->arp.req->arp_sip[2], frame->arp.req->arp_sip[3]);
-    fprintf(dst, "(%02X:%02X:%02X:%02X:%02X:%02X)",
-	    frame->arp.req->arp_sha[0], frame->arp.req->arp_sha[1], frame->arp.req->arp_sha[2], frame->arp.req->arp_sha[3], frame->arp.req->arp_sha[4], frame->arp.req->arp_sha[5]);
-  }
-  if(ntohs(frame->arp.header->ar_op)==ARPOP_REPLY ) {
-    fprintf(dst, "Reply: %02d.%02d.%02d.%02d is at (%02X:%02X:%02X:%02X:%02X:%02X) tell ",
-	    frame->arp.req->arp_tip[0], frame->arp.req->arp_tip[1], frame->arp.req->arp_tip[2], frame->arp.req->arp_tip[3],
-	    frame->arp.req->arp_tha[0], frame->arp.req->arp_tha[1], frame->arp.req->arp_tha[2], frame->arp.req->arp_tha[3], frame->arp.req->arp_tha[4], frame->arp.req->arp_tha[5]);
-    fprintf(dst, " %02d.%02d.%02d.%02d (%02X:%02X:%02X:%02X:%02X:%02X)",
-	    frame->arp.req->arp_sip[0], frame->arp.req->arp_sip[1], frame->arp.req->arp_sip[2], frame->arp.req->arp_sip[3],
-	    frame->arp.req->arp_sha[0], frame->arp.req->arp_sha[1], frame->arp.req->arp_sha[2], frame->arp.req->arp_sha[3], frame->arp.req->arp_sha[4], frame->arp.req->arp_sha[5]);
-  }
-}
+  fprintf(dst, "IPv6[");
+  fprintf(dst, "Len=%d:", ntohs(frame->ip6->ip6_plen));
+  fprintf(dst, "Hop=%d:", frame->ip6->ip6_hlim);
+  fprintf(dst, "Flow=%05x]:\t", ntohl(frame->ip6->ip6_flow) & 0xFFFFF);
 
-/**
- * Dump the content of data as hexadecimal (and its ascii repr.)
- */
-static void hexdump(FILE* fp, const char* data, size_t size){
-  const size_t align = size + (size % 16);
-  fputs("[0000]  ", fp);
-  for( int i=0; i < align; i++){
-    if ( i < size ){
+  if ( frame->type & TRANSPORT_TCP ){
+    fprintf(dst, "TCP(HDR[%d]):\t [", 4*frame->tcp->doff);
+    if(frame->tcp->syn) {
+      fprintf(dst, "S");
+    }
+    if(frame->tcp->fin) {
+      fprintf(dst, "F");
+    }
+    if(frame->tcp->ack) {
+      fprintf(dst, "A");
+    }
+    if(frame->tcp->psh) {
+      fprintf(dst, "P");
+    }
+    if(frame->tcp->urg) {
+      fprintf(dst, "U");
+    }
+    if(frame->tcp->rst) {
+      fprintf(dst, "R");
+    }
+
+    fprintf(dst, "] [%s]:%d ", src, (u_int16_t)ntohs(frame->tcp->source));
+    fprintf(dst, " --> [%s]:%d", dst_addr, (u_int16_t)ntohs(frame->tcp->dest));
+  }
+
+  if ( frame->type & TRANSPORT_UDP ){
+    fprintf(dst, "UDP(HDR[8]DATA[%d]):\t [%s]:%d ", (u_int16_t)(ntohs(frame->udp->len)-8), src, (u_int16_t)ntohs(frame->udp->source));
+    fprintf(dst, " --> [%s]:%d", dst_addr, (u_int16_t)ntohs(frame->udp->dest));
+  }
+
+  if ( frame->type & PACKET_ICMP ){
+    fprintf(dst, "ICMPv6:\t %s ", src);
+    fprintf(dst, " --> %s ", dst_addr);
+    fprintf(dst, "Type %d , code %d", frame->icmp6->icmp6_type, frame->icmp6->icmp6_code);
+  }
+}
+
+void print_frame_tunnel(FILE* dst, const struct frame_t* frame){
+  char src[INET6_ADDRSTRLEN];
+  char dst_addr[INET6_ADDRSTRLEN];
+  if ( frame->outer.ip ){
+    inet_ntop(AF_INET, &frame->outer.ip->ip_src, src, sizeof(src));
+    inet_ntop(AF_INET, &frame->outer.ip->ip_dst, dst_addr, sizeof(dst_addr));
+  } else {
+    inet_ntop(AF_INET6, &frame->outer.ip6->ip6_src, src, sizeof(src));
+    inet_ntop(AF_INET6, &frame->outer.ip6->ip6_dst, dst_addr, sizeof(dst_addr));
+  }
+
+  fprintf(dst, "%s(%s --> %s", frame_tunnel_name(frame->outer.tunnel), src, dst_addr);
+  if ( frame->outer.depth > 1 ){
+    fprintf(dst, ", depth %d", frame->outer.depth);
+  }
+  fprintf(dst, "):\t");
+}
+
+void print_frame_arp(FILE* dst, const struct frame_t* frame){
+  fprintf(dst, "ARP (HDR[%zd]):", sizeof(struct my_arpreq) + sizeof(struct arphdr));
+
+  if(ntohs(frame->arp.header->ar_op)==ARPOP_REQUEST ) {
+    fprintf(dst, "Request: %02d.%02d.%02d.%02d tell ",
+	    frame->arp.req->arp_tip[0], frame->arp.req->arp_tip[1], frame->arp.req->arp_tip[2], frame->arp.req->arp_tip[3]);
+    fprintf(dst, "%02d.%02d.%02d.%02d ",
+	    frame->arp.req->arp_sip[0], frame->arp.req->arp_sip[1], frame->arp.req->arp_sip[2], frame->arp.req->arp_sip[3]);
+    fprintf(dst, "(%02X:%02X:%02X:%02X:%02X:%02X)",
+	    frame->arp.req->arp_sha[0], frame->arp.req->arp_sha[1], frame->arp.req->arp_sha[2], frame->arp.req->arp_sha[3], frame->arp.req->arp_sha[4], frame->arp.req->arp_sha[5]);
+  }
+  if(ntohs(frame->arp.header->ar_op)==ARPOP_REPLY ) {
+    fprintf(dst, "Reply: %02d.%02d.%02d.%02d is at (%02X:%02X:%02X:%02X:%02X:%02X) tell ",
+	    frame->arp.req->arp_tip[0], frame->arp.req->arp_tip[1], frame->arp.req->arp_tip[2], frame->arp.req->arp_tip[3],
+	    frame->arp.req->arp_tha[0], frame->arp.req->arp_tha[1], frame->arp.req->arp_tha[2], frame->arp.req->arp_tha[3], frame->arp.req->arp_tha[4], frame->arp.req->arp_tha[5]);
+    fprintf(dst, " %02d.%02d.%02d.%02d (%02X:%02X:%02X:%02X:%02X:%02X)",
+	    frame->arp.req->arp_sip[0], frame->arp.req->arp_sip[1], frame->arp.req->arp_sip[2], frame->arp.req->arp_sip[3],
+	    frame->arp.req->arp_sha[0], frame->arp.req->arp_sha[1], frame->arp.req->arp_sha[2], frame->arp.req->arp_sha[3], frame->arp.req->arp_sha[4], frame->arp.req->arp_sha[5]);
+  }
+}
+
+/**
+ * Dump the content of data as hexadecimal (and its ascii repr.)
+ */
+static void hexdump(FILE* fp, const char* data, size_t size){
+  const size_t align = size + (size % 16);
+  fputs("[0000]  ", fp);
+  for( int i=0; i < align; i++){
+    if ( i < size ){
       fprintf(fp, "%02X ", data[i] & 0xff);
     } else {
       fputs("   ", fp);
@@ -248,15 +897,23 @@ static void hexdump(FILE* fp, const char* data, size_t size){
       }
     }
   }
-  printf("\n");
+  fputc('\n', fp);
 }
 
 void print_frame(FILE* dst, const struct frame_t* frame, int show_payload){
-  if ( ntohs(frame->eth->h_proto) == ETHERTYPE_IP ){
+  if ( frame->type & PACKET_TUNNEL ){
+    print_frame_tunnel(dst, frame);
+  }
+
+  if ( frame->type & PACKET_IP ){
     print_frame_ip(dst, frame);
   }
 
-  if ( ntohs(frame->eth->h_proto) == ETHERTYPE_ARP ){
+  if ( frame->type & PACKET_IPV6 ){
+    print_frame_ip6(dst, frame);
+  }
+
+  if ( frame->type & PACKET_ARP ){
     print_frame_arp(dst, frame);
   }
 
@@ -271,195 +928,1808 @@ static int min(int a, int b){
   return b + ((a - b) & -(a < b));
 }
 
-static int max(int a, int b){
-  return a - ((a - b) & -(a < b));
-}
+/**
+ * Idle accounting for a thread reading streams. The clock is only read when
+ * the thread goes idle or becomes busy again.
+ */
+struct idle {
+  struct timespec started;
+  struct timespec since;  /* start of the current idle period */
+  unsigned int rounds;    /* consecutive rounds without packets */
+  uint64_t idle_ns;
+};
+
+/**
+ * The oldest packet of a stream queue, held (claimed) by the merge until it
+ * is emitted.
+ */
+struct merge_head {
+  uint64_t pos;
+  const struct packet* pkt;
+};
+
+struct stream_slot {
+  int id;
+  struct stream* stream;
+  struct filter* filter;
+  size_t snaplen;
+  volatile int removed;
+
+  /* overflow, updated by both the reader and the consumer/merge thread */
+  uint64_t dropped;
+  uint64_t dropped_bytes;
+
+  /* updated by the thread reading the stream */
+  struct classify_stats classify;
+
+  /* merge mode: each stream has its own reader thread which stores packets in
+   * a private queue. In fair mode the consumer thread stores packets in the
+   * queue instead of the buffer. */
+  struct consumer_thread* con;
+  pthread_t thread;
+  struct idle idle;
+  struct ring queue;
+
+  /* fair mode, the deficit is owned by the polling thread */
+  unsigned int weight;
+  uint64_t deficit;
+
+  /* owned by the merge thread */
+  struct merge_head head;
+  int held;
+  int known;
+  struct timespec seen; /* when the stream last had a packet queued */
+};
+
+/**
+ * The streams are kept in a table which is replaced (never modified) when a
+ * stream is added or removed. The thread(s) iterating the table signal a
+ * quiescent state after each round, after which an old table (and removed
+ * streams) can be freed.
+ */
+struct stream_table {
+  struct stream_table* retired; /* next older table waiting to be freed */
+  uint64_t quiescent;           /* quiescent count when it was replaced */
+  uint64_t poll_epoch;          /* poll epoch when it was replaced */
+  size_t count;
+  struct stream_slot* slot[0];
+};
+
+struct consumer_reader {
+  struct consumer_thread* con;
+  struct ring* ring;
+  struct ring_cursor* cursor;
+  int fair; /* default reader in fair mode, ring and cursor are of the stream queue last read */
+};
 
 struct consumer_thread {
   pthread_t thread;
-  pthread_mutex_t mutex;
-  sem_t semaphore;
-  
+
   volatile int state;
   timepico time;
 
-  struct stream* stream[4];
-  struct filter* filter[4];
+  struct stream_table* table;
+  struct stream_table* retired; /* replaced tables, see replace_table() */
+  pthread_mutex_t table_mutex; /* serializes writers of table and opening of readers */
+  uint64_t quiescent;          /* bumped by the consumer thread after each round */
+  int next_id;
 
   timepico delay;
-  int read_pos;
-  int write_pos;
-  size_t buffer_size;
-  struct packet pkt[0];
-};
+  unsigned int pkt_counter;
 
-static void* consumer_thread_func(struct consumer_thread* con){
-  static const size_t caphead_offset = offsetof(struct packet, caphead);
-  static const size_t buffer_offset  = offsetof(struct packet, buf);
-  static unsigned int pkt_counter = 1;
+  /* idle policy */
+  unsigned int idle_spin;
+  unsigned int idle_timeout;
+  struct idle idle;
 
-  con->state = 1;
-  while ( con->state == 1 ){
-    for ( int i = 0; i < 4; i++ ){
-      if ( !con->stream[i] ){
-	continue;
-      }
+  /* merge mode */
+  int merge;
+  size_t merge_buffer_size;
+  timepico merge_lateness;
+  uint64_t late_count;
 
-      cap_head* cp;
-      long ret = stream_read(con->stream[i], &cp, con->filter[i], NULL);
-      if ( ret == 0 ){
-	pthread_mutex_lock(&con->mutex);
-	{
-	  struct packet* pkt = &con->pkt[con->write_pos];
-	  char* data = (char*)pkt;
-	  
-	  const int overwrite = pkt->used == 1;
-	  
-	  if ( overwrite ){
-	    fprintf(stderr, "consumer not reading fast enough. HERE BE DRAGONS!\n");
-	    con->read_pos = (con->read_pos + 1) % con->buffer_size;
-	  }
+  /* overflow policy */
+  enum consumer_overflow overflow;
+  consumer_overflow_func notify;
+  void* notify_arg;
+  uint64_t notify_interval; /* ns */
+  uint64_t notify_time;     /* last notification */
+  uint64_t notified;        /* drop_count at the last notification */
+  uint64_t drop_count;
+  uint64_t drop_bytes;
+  struct spill spill;       /* CONSUMER_SPILL only */
 
-	  const size_t len = min(cp->caplen, MAX_CAPTURE_SIZE);
-	  
-	  memcpy(data + caphead_offset, cp, sizeof(struct cap_header));
-	  memcpy(data + buffer_offset,  cp->payload, len);
-	  pkt->used = 1;
-	  pkt->packet_id = pkt_counter++;
-	  pkt->stream_id = i;
-	  
-	  /* apply delay */
-	  pkt->caphead.ts.tv_sec  += con->delay.tv_sec;
-	  pkt->caphead.ts.tv_psec += con->delay.tv_psec;
-	  if ( pkt->caphead.ts.tv_psec > 1000000000000 ){ /* wrap psec */
-	    pkt->caphead.ts.tv_sec += 1;
-	    pkt->caphead.ts.tv_psec -= 1000000000000;
-	  }
+  unsigned int tunnel_depth;
+  classify_func classify;   /* NULL for classify_frame() */
+  struct toeplitz* toeplitz; /* FLOW_HASH_TOEPLITZ only */
+  struct reasm* reasm;       /* reassemble only */
 
-	  con->write_pos = (con->write_pos + 1) % con->buffer_size;
-	  
-	  /* if a packet was overwritten the semaphore is not raised as a new packet wasn't added. */
-	  if ( !overwrite ){
-	    sem_post(&con->semaphore);
-	  }
+  /* classification counters of removed streams (table_mutex) */
+  struct classify_stats classify_removed;
 
-	}
-	pthread_mutex_unlock(&con->mutex);
-      } else if ( ret == EAGAIN ){
-	continue;
-      } else {
-	fprintf(stderr, "read_post failed with code 0x%08lX: %s\n", ret, caputils_error_string(ret));
-      }
+  struct ring ring;
+  struct consumer_reader reader; /* default reader (cursor 0), unless broadcast */
+
+  /* flow-affine shards, used instead of ring */
+  unsigned int shards;
+  struct ring* shard;
+  struct consumer_reader* shard_reader;
+
+  /* fair mode, the stream queues are used instead of ring. The polling thread
+   * holds references to the stream table while poll_epoch is odd. */
+  int fair;
+  size_t fair_buffer_size;
+  size_t fair_quantum;
+  struct ring_bell bell;
+  uint64_t poll_epoch;
+  size_t drr_index;  /* stream currently served */
+  int drr_visit;     /* set when the stream has been given its quantum */
+
+  struct ring_mem mem; /* allocation of the buffer and all queues */
+};
+
+static uint64_t timespec_diff_ns(const struct timespec* a, const struct timespec* b){
+  return (b->tv_sec - a->tv_sec) * 1000000000ULL + (b->tv_nsec - a->tv_nsec);
+}
+
+static void idle_init(struct idle* idle){
+  memset(idle, 0, sizeof(struct idle));
+  clock_gettime(CLOCK_MONOTONIC, &idle->started);
+}
+
+/**
+ * Account for a round which read the given number of packets. Returns non-zero
+ * when the spin budget is exhausted and the thread should block.
+ */
+static int idle_round(struct idle* idle, const struct consumer_thread* con, int packets){
+  if ( packets > 0 ){
+    if ( idle->rounds > 0 ){
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      __atomic_store_n(&idle->idle_ns, idle->idle_ns + timespec_diff_ns(&idle->since, &now), __ATOMIC_RELAXED);
+      idle->rounds = 0;
     }
+    return 0;
   }
 
-  return 0;
+  if ( idle->rounds++ == 0 ){
+    clock_gettime(CLOCK_MONOTONIC, &idle->since);
+  }
+  return idle->rounds > con->idle_spin;
 }
 
-int consumer_thread_init(consumer_thread_t* conptr, size_t buffer_size, const timepico* delay){
-  size_t size = sizeof(struct consumer_thread) + sizeof(struct packet) * buffer_size;
-  consumer_thread_t con = (struct consumer_thread*)malloc(size);
-  memset(con, 0, size);
-  con->buffer_size = buffer_size;
+/**
+ * Timeout to pass to stream_read(), NULL while spinning. When blocking, the
+ * idle timeout is divided among the streams read by the same thread.
+ */
+static struct timeval* idle_timeout(const struct idle* idle, const struct consumer_thread* con, int streams, struct timeval* tv){
+  if ( idle->rounds <= con->idle_spin ){
+    return NULL;
+  }
 
-  if ( delay ){
-    con->delay.tv_sec  = delay->tv_sec;
-    con->delay.tv_psec = delay->tv_psec;
+  const unsigned long us = con->idle_timeout * 1000UL / (streams > 0 ? streams : 1);
+  tv->tv_sec  = us / 1000000;
+  tv->tv_usec = us % 1000000;
+  return tv;
+}
+
+/**
+ * Back off while there is nothing to do and no stream to block on: spin, then
+ * sleep exponentially longer up to the idle timeout.
+ */
+static void idle_sleep(const struct idle* idle, const struct consumer_thread* con){
+  if ( idle->rounds <= con->idle_spin ){
+    return;
   }
 
-  pthread_mutex_init(&con->mutex, NULL);
-  sem_init(&con->semaphore, 0, 0);
-  
-  *conptr = con;
-  return pthread_create(&con->thread, NULL, (void* (*)(void*))consumer_thread_func, con);
+  const unsigned int n = idle->rounds - con->idle_spin;
+  uint64_t ns = 1000ULL << (n < 20 ? n : 20);
+  if ( ns > con->idle_timeout * 1000000ULL ){
+    ns = con->idle_timeout * 1000000ULL;
+  }
+
+  const struct timespec ts = {ns / 1000000000, ns % 1000000000};
+  nanosleep(&ts, NULL);
 }
 
-long consumer_thread_add_stream(consumer_thread_t con, const stream_addr_t* src, const char* nic, int port, struct filter* filter){
-  struct stream* st;
-  long ret;
-  if( (ret=stream_open(&st, src, nic, port)) != 0 ) {
-    return ret;
+static void timepico_add(timepico* ts, const timepico* delta){
+  ts->tv_sec  += delta->tv_sec;
+  ts->tv_psec += delta->tv_psec;
+  if ( ts->tv_psec >= 1000000000000 ){ /* wrap psec */
+    ts->tv_sec += 1;
+    ts->tv_psec -= 1000000000000;
   }
-  
-  int i;
-  for ( i = 0; i < 4; i++ ){
-    if ( con->stream[i] ){
-      continue;
-    }
-    con->stream[i] = st;
-    con->filter[i] = filter;
-    break;
+}
+
+/**
+ * Number of bytes to store of a packet from the given stream.
+ */
+static size_t ingest_caplen(const struct stream_slot* slot, const cap_head* cp){
+  size_t caplen = min(cp->caplen, MAX_RECORD_CAPLEN);
+  if ( slot->snaplen > 0 ){
+    caplen = min(caplen, slot->snaplen);
   }
-  if ( i == 5 ){
-    stream_close(st);
-    return -1;
+  return caplen;
+}
+
+static void ingest_classify_frame(const struct consumer_thread* con, const char* data, size_t caplen, struct frame_info* info){
+  if ( con->classify ){
+    con->classify(data, caplen, info);
+  } else {
+    classify_frame(data, caplen, info, con->tunnel_depth);
   }
+}
 
-  return 0;
+/**
+ * Classify a packet read from slot and count the result.
+ */
+static void ingest_classify(const struct consumer_thread* con, struct stream_slot* slot, const char* data, size_t caplen, struct frame_info* info){
+  ingest_classify_frame(con, data, caplen, info);
+  classify_count(&slot->classify, info);
 }
 
-int consumer_thread_destroy(consumer_thread_t con){
-  /** @todo IMPLEMENT ME! */
-  return 0;
+/**
+ * Flow hash of a classified packet read from a stream, see packet.hash.
+ */
+static uint32_t ingest_hash(const struct consumer_thread* con, const char* data, size_t caplen, const struct frame_info* info){
+  if ( con->toeplitz ){
+    return flow_hash_toeplitz(con->toeplitz, data, caplen, info);
+  }
+  return flow_hash_crc32c(data, caplen, info);
 }
 
-int consumer_thread_poll(consumer_thread_t con, struct packet* pkt, unsigned int timeout){
+static struct stream_slot* find_slot(const struct consumer_thread* con, int stream_id);
+
+static void default_notify(consumer_thread_t con, uint64_t dropped, uint64_t total, void* arg){
+  fprintf(stderr, "consumer not reading fast enough, %"PRIu64" packets dropped (%"PRIu64" in total)\n", dropped, total);
+}
+
+/**
+ * Notify about dropped packets unless a notification was made during the
+ * last notify_interval. Several threads may drop packets, whichever gets to
+ * update notify_time first makes the call.
+ */
+static void overflow_notify(struct consumer_thread* con){
   struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  const uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  uint64_t last = __atomic_load_n(&con->notify_time, __ATOMIC_RELAXED);
+  if ( last != 0 && now - last < con->notify_interval ){
+    return;
+  }
+  if ( !__atomic_compare_exchange_n(&con->notify_time, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ){
+    return;
+  }
+
+  const uint64_t total = __atomic_load_n(&con->drop_count, __ATOMIC_RELAXED);
+  const uint64_t dropped = total - __atomic_exchange_n(&con->notified, total, __ATOMIC_RELAXED);
+  if ( dropped > 0 ){
+    con->notify(con, dropped, total, con->notify_arg);
+  }
+}
+
+/**
+ * Account for a dropped packet. slot is NULL if the stream has been removed.
+ */
+static void count_drop(struct consumer_thread* con, struct stream_slot* slot, size_t caplen){
+  if ( slot ){
+    __atomic_add_fetch(&slot->dropped, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->dropped_bytes, caplen, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&con->drop_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&con->drop_bytes, caplen, __ATOMIC_RELAXED);
+  overflow_notify(con);
+}
+
+/**
+ * A packet in the buffer was overwritten (the packet may be from any stream).
+ * Only called from the thread writing to the buffer, which holds the current
+ * stream table.
+ */
+static void buffer_drop(struct consumer_thread* con, const struct ring_meta* meta){
+  count_drop(con, find_slot(con, meta->stream_id), meta->caplen);
+}
+
+/**
+ * A packet in a merge queue was overwritten.
+ */
+static void queue_drop(struct stream_slot* slot, const struct ring_meta* meta){
+  count_drop(slot->con, slot, meta->caplen);
+}
 
-  /* create absolute timeout. there is no point in having higher precision than
-   * ms for the timeout param. The application cannot guarantee anything and most
-   * of the time it waits for longer periods. Dealing with nanosec directly would
-   * just mean having to deal with large numbers for no real purpose. */
-  struct timespec timeout_ts = ts;
-  timeout_ts.tv_nsec += timeout * 1000000; /* to nanosec */
-  if ( timeout_ts.tv_nsec > 1000000000 ){
-    timeout_ts.tv_sec += 1;
-    timeout_ts.tv_nsec -= 1000000000;
+/**
+ * Copy a packet into a reserved record of ring, or into the spill if ring is
+ * NULL.
+ */
+static void fill_packet(struct ring* ring, struct packet* pkt, const struct stream_slot* slot, const cap_head* cp, size_t caplen, const struct frame_info* info){
+  memcpy(&pkt->caphead, cp, sizeof(struct cap_header));
+  pkt->info = *info;
+  if ( ring ){
+    ring_copy_payload(ring, pkt->buf, cp->payload, caplen);
+  } else {
+    memcpy(pkt->buf, cp->payload, caplen);
   }
+  pkt->caphead.caplen = caplen;
+  pkt->used = 1;
+  pkt->stream_id = slot->id;
+}
 
-  if ( sem_timedwait(&con->semaphore, &timeout_ts) != 0 ){
-    if ( errno != ETIMEDOUT ){
-      fprintf(stderr, "sem_trywait() returned %d: %s\n", errno, strerror(errno));
+/**
+ * Copy a packet into a new (not yet committed) record according to the
+ * overflow policy. Returns NULL if the packet had to be discarded.
+ */
+static struct packet* store_packet(struct consumer_thread* con, struct ring* ring, struct stream_slot* slot, const cap_head* cp, size_t caplen, const struct frame_info* info){
+  /* merge queues are never spilled, the reader waits for the merge instead */
+  const int block = con->overflow == CONSUMER_BLOCK || con->overflow == CONSUMER_SPILL;
+
+  struct packet* pkt;
+  while ( !(pkt=ring_reserve(ring, caplen, con->overflow == CONSUMER_DROP_OLDEST)) ){
+    if ( !block || con->state != 1 ){
+      count_drop(con, slot, caplen);
+      return NULL;
     }
+    ring_wait_space(ring, caplen, con->idle_timeout);
+  }
+
+  fill_packet(ring, pkt, slot, cp, caplen, info);
+  return pkt;
+}
+
+/**
+ * Move spilled packets back into the buffer for as long as there is room.
+ * Returns the number of packets moved.
+ */
+static int spill_refill(struct consumer_thread* con){
+  if ( con->overflow != CONSUMER_SPILL ){
     return 0;
   }
 
-  timepico tp = timespec_to_timepico(ts);
-  struct packet* tmp;
+  int n = 0;
+  const struct packet* src;
+  while ( (src=spill_peek(&con->spill)) ){
+    struct packet* pkt = ring_reserve(&con->ring, src->caphead.caplen, 0);
+    if ( !pkt ){
+      break;
+    }
+    memcpy(pkt, src, ring_record_size(src->caphead.caplen));
+    ring_commit(&con->ring, pkt);
+    spill_consume(&con->spill);
+    n++;
+  }
+  return n;
+}
+
+/**
+ * Store a classified packet from slot.
+ */
+static void consumer_store(struct consumer_thread* con, struct stream_slot* slot, const cap_head* cp, const struct frame_info* info){
+  const size_t caplen = ingest_caplen(slot, cp);
+  struct ring* ring = &con->ring;
+  struct packet* pkt = NULL;
+  int spilled = 0;
 
-  pthread_mutex_lock(&con->mutex);
-  {
-    tmp = &con->pkt[con->read_pos];
-    
-    if ( timecmp(&tp, &tmp->caphead.ts) < 0 ){
-      pthread_mutex_unlock(&con->mutex);
-      return 0; /* defer */
+  const uint32_t hash = ingest_hash(con, cp->payload, caplen, info);
+
+  if ( con->fair ){
+    ring = &slot->queue;
+    pkt = store_packet(con, ring, slot, cp, caplen, info);
+  } else if ( con->shards > 0 ){
+    ring = &con->shard[hash % con->shards];
+    pkt = store_packet(con, ring, slot, cp, caplen, info);
+  } else if ( con->overflow != CONSUMER_SPILL ){
+    pkt = store_packet(con, ring, slot, cp, caplen, info);
+  } else {
+    /* once packets have been spilled new packets must follow them until the
+     * spill is empty again, or they would overtake them */
+    spill_refill(con);
+    if ( spill_empty(&con->spill) && (pkt=ring_reserve(&con->ring, caplen, 0)) ){
+      fill_packet(ring, pkt, slot, cp, caplen, info);
+    } else if ( (pkt=spill_reserve(&con->spill, caplen)) ){
+      fill_packet(NULL, pkt, slot, cp, caplen, info);
+      spilled = 1;
+    } else {
+      count_drop(con, slot, caplen);
     }
-    
-    con->pkt[con->read_pos].used = 0;
-    con->read_pos = (con->read_pos + 1) % con->buffer_size;
   }
-  pthread_mutex_unlock(&con->mutex);
-    
-  memcpy(pkt, tmp, sizeof(struct packet));
-  return 1;
+
+  if ( !pkt ){
+    return;
+  }
+
+  pkt->packet_id = con->pkt_counter++;
+  pkt->hash = hash;
+  timepico_add(&pkt->caphead.ts, &con->delay);
+  if ( spilled ){
+    spill_commit(&con->spill, pkt);
+  } else {
+    ring_commit(ring, pkt);
+  }
+  if ( con->fair ){
+    ring_bell_ring(&con->bell);
+  }
 }
 
-int consumer_thread_pending(consumer_thread_t con){
-  int sval;
-  sem_getvalue(&con->semaphore, &sval);
-  return max(sval, 0); /* POSIX.1-2001 allows sval to be -(threads blocking) */
+/**
+ * Store a packet given back by the reassembler, see reasm_emit_func.
+ */
+static void reasm_emit(struct consumer_thread* con, int stream_id, const cap_head* cp, const struct frame_info* info){
+  struct stream_slot* slot = find_slot(con, stream_id);
+  if ( !slot ){
+    /* the stream has been removed while the fragments were held */
+    count_drop(con, NULL, cp->caplen);
+    return;
+  }
+
+  struct frame_info classified;
+  if ( !info ){
+    ingest_classify_frame(con, cp->payload, ingest_caplen(slot, cp), &classified);
+    classified.type |= PACKET_REASSEMBLED;
+    info = &classified;
+  }
+  consumer_store(con, slot, cp, info);
 }
 
-void consumer_lock(consumer_thread_t con){
-  pthread_mutex_lock(&con->mutex);
+/**
+ * Store a packet read from slot, unless it is a fragment held for
+ * reassembly. info is the classification of the packet if it is already known
+ * (merge queues), otherwise NULL.
+ */
+static void consumer_push(struct consumer_thread* con, struct stream_slot* slot, const cap_head* cp, const struct frame_info* info){
+  struct frame_info classified;
+  if ( !info ){
+    ingest_classify(con, slot, cp->payload, ingest_caplen(slot, cp), &classified);
+    info = &classified;
+  }
+
+  if ( con->reasm ){
+    reasm_advance(con->reasm, &cp->ts);
+    switch ( reasm_add(con->reasm, slot->id, cp, ingest_caplen(slot, cp), info) ){
+    case REASM_NONE:
+      break;
+    case REASM_HELD:
+      return;
+    case REASM_REJECT:
+      classified = *info;
+      classified.type |= PACKET_FRAGMENT;
+      info = &classified;
+      break;
+    }
+  }
+
+  consumer_store(con, slot, cp, info);
 }
 
-void consumer_unlock(consumer_thread_t con){
-  pthread_mutex_unlock(&con->mutex);
+/**
+ * Signal that the calling thread holds no references to an old stream table.
+ */
+static void consumer_quiescent(struct consumer_thread* con){
+  __atomic_add_fetch(&con->quiescent, 1, __ATOMIC_SEQ_CST);
 }
 
-struct packet* consumer_buffer_get(consumer_thread_t con, unsigned int index){
-  return &con->pkt[index];
+/**
+ * Wait until the consumer thread has passed a quiescent state, i.e. until no
+ * stream table published before the call is in use any longer.
+ */
+static void consumer_synchronize(struct consumer_thread* con){
+  const uint64_t quiescent = __atomic_load_n(&con->quiescent, __ATOMIC_SEQ_CST);
+  const struct timespec ts = {0, 100000};
+  while ( con->state == 1 && __atomic_load_n(&con->quiescent, __ATOMIC_SEQ_CST) == quiescent ){
+    nanosleep(&ts, NULL);
+  }
+}
+
+/**
+ * Fair mode: the polling thread enters the poll epoch before looking at the
+ * stream table and leaves it once the packets it took are handed back.
+ */
+static void poll_enter(struct consumer_thread* con){
+  __atomic_add_fetch(&con->poll_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+static void poll_leave(struct consumer_thread* con){
+  __atomic_add_fetch(&con->poll_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wait until the polling thread holds no references to a stream table
+ * published before the call.
+ */
+static void poll_synchronize(struct consumer_thread* con){
+  const uint64_t epoch = __atomic_load_n(&con->poll_epoch, __ATOMIC_SEQ_CST);
+  const struct timespec ts = {0, 100000};
+  while ( (epoch & 1) && con->state == 1 && __atomic_load_n(&con->poll_epoch, __ATOMIC_SEQ_CST) == epoch ){
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void* stream_reader_func(struct stream_slot* slot){
+  struct consumer_thread* con = slot->con;
+  struct timeval tv;
+
+  while ( con->state == 1 && !slot->removed ){
+    cap_head* cp;
+    long ret = stream_read(slot->stream, &cp, slot->filter, idle_timeout(&slot->idle, con, 1, &tv));
+    idle_round(&slot->idle, con, ret == 0);
+    if ( ret == 0 ){
+      const size_t caplen = ingest_caplen(slot, cp);
+      struct frame_info info;
+      ingest_classify(con, slot, cp->payload, caplen, &info);
+      struct packet* pkt = store_packet(con, &slot->queue, slot, cp, caplen, &info);
+      if ( pkt ){
+	ring_commit(&slot->queue, pkt);
+      }
+    } else if ( ret == EAGAIN ){
+      continue;
+    } else {
+      fprintf(stderr, "read_post failed with code 0x%08lX: %s\n", ret, caputils_error_string(ret));
+    }
+  }
+
+  return 0;
+}
+
+static int merge_less(const struct stream_slot* a, const struct stream_slot* b){
+  return timecmp(&a->head.pkt->caphead.ts, &b->head.pkt->caphead.ts) < 0;
+}
+
+static void heap_push(struct stream_slot** heap, size_t* size, struct stream_slot* slot){
+  size_t i = (*size)++;
+  heap[i] = slot;
+  while ( i > 0 && merge_less(heap[i], heap[(i-1)/2]) ){
+    struct stream_slot* tmp = heap[i];
+    heap[i] = heap[(i-1)/2];
+    heap[(i-1)/2] = tmp;
+    i = (i-1)/2;
+  }
+}
+
+static void heap_pop(struct stream_slot** heap, size_t* size){
+  heap[0] = heap[--(*size)];
+  size_t i = 0;
+  for (;;){
+    const size_t l = 2*i + 1;
+    const size_t r = 2*i + 2;
+    size_t m = i;
+    if ( l < *size && merge_less(heap[l], heap[m]) ) m = l;
+    if ( r < *size && merge_less(heap[r], heap[m]) ) m = r;
+    if ( m == i ){
+      break;
+    }
+    struct stream_slot* tmp = heap[i];
+    heap[i] = heap[m];
+    heap[m] = tmp;
+    i = m;
+  }
+}
+
+/**
+ * k-way merge of the stream queues using a min-heap over their oldest
+ * packets. The oldest packet is emitted when every stream has a packet queued
+ * (so nothing older can arrive) or when it is older than the watermark, i.e.
+ * the newest timestamp seen minus the allowed lateness. A stream which has had
+ * nothing queued for the same lateness in wall time is not waited for.
+ */
+static void merge_func(struct consumer_thread* con){
+  struct stream_slot** heap = NULL;
+  size_t heap_capacity = 0;
+  size_t heap_size = 0;
+  timepico newest = {0, 0};
+  timepico last = {0, 0};
+  const uint64_t lateness = con->merge_lateness.tv_sec * 1000000000ULL + con->merge_lateness.tv_psec / 1000;
+
+  while ( con->state == 1 ){
+    const struct stream_table* table = __atomic_load_n(&con->table, __ATOMIC_ACQUIRE);
+    size_t waiting = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ( table->count > heap_capacity ){
+      struct stream_slot** grown = realloc(heap, table->count * sizeof(struct stream_slot*));
+      if ( grown ){
+	heap = grown;
+	heap_capacity = table->count;
+      }
+    }
+
+    /* pull the oldest packet from every stream not in the heap */
+    for ( size_t i = 0; i < table->count; i++ ){
+      struct stream_slot* slot = table->slot[i];
+      if ( slot->held ){
+	continue;
+      }
+
+      /* the heap could not be grown, the other streams wait for a later round */
+      if ( heap_size == heap_capacity ){
+	break;
+      }
+      if ( !slot->known ){
+	slot->seen = now;
+	slot->known = 1;
+      }
+
+      size_t count;
+      const uint64_t pos = ring_claim(&slot->queue, &slot->queue.cursor[0], 1, NULL, &count);
+      if ( count == 0 ){
+	/* a removed stream is only drained */
+	waiting += !slot->removed && timespec_diff_ns(&slot->seen, &now) < lateness;
+	continue;
+      }
+
+      slot->head.pos = pos;
+      slot->head.pkt = ring_at(&slot->queue, pos);
+      slot->seen = now;
+      __atomic_store_n(&slot->held, 1, __ATOMIC_RELEASE);
+      heap_push(heap, &heap_size, slot);
+      if ( timecmp(&slot->head.pkt->caphead.ts, &newest) > 0 ){
+	newest = slot->head.pkt->caphead.ts;
+      }
+    }
+
+    if ( heap_size == 0 ){
+      consumer_quiescent(con);
+      idle_round(&con->idle, con, spill_refill(con));
+      idle_sleep(&con->idle, con);
+      continue;
+    }
+
+    struct stream_slot* slot = heap[0];
+    timepico watermark = slot->head.pkt->caphead.ts;
+    timepico_add(&watermark, &con->merge_lateness);
+
+    if ( waiting > 0 && timecmp(&watermark, &newest) > 0 ){
+      consumer_quiescent(con);
+      idle_round(&con->idle, con, spill_refill(con));
+      idle_sleep(&con->idle, con);
+      continue;
+    }
+    idle_round(&con->idle, con, 1);
+
+    if ( timecmp(&slot->head.pkt->caphead.ts, &last) < 0 ){
+      __atomic_store_n(&con->late_count, con->late_count + 1, __ATOMIC_RELAXED);
+    } else {
+      last = slot->head.pkt->caphead.ts;
+    }
+
+    consumer_push(con, slot, &slot->head.pkt->caphead, &slot->head.pkt->info);
+    ring_release(&slot->queue, &slot->queue.cursor[0], ring_next(&slot->queue, slot->head.pos), 1);
+    slot->seen = now;
+    heap_pop(heap, &heap_size);
+    __atomic_store_n(&slot->held, 0, __ATOMIC_RELEASE);
+    consumer_quiescent(con);
+  }
+
+  free(heap);
+}
+
+static void* consumer_thread_func(struct consumer_thread* con){
+  if ( con->merge ){
+    merge_func(con);
+    return 0;
+  }
+
+  struct timeval tv;
+  while ( con->state == 1 ){
+    const struct stream_table* table = __atomic_load_n(&con->table, __ATOMIC_ACQUIRE);
+    int packets = 0;
+
+    for ( size_t i = 0; i < table->count; i++ ){
+      struct stream_slot* slot = table->slot[i];
+      if ( slot->removed ){
+	continue;
+      }
+
+      cap_head* cp;
+      long ret = stream_read(slot->stream, &cp, slot->filter, idle_timeout(&con->idle, con, table->count, &tv));
+      if ( ret == 0 ){
+	consumer_push(con, slot, cp, NULL);
+	packets++;
+      } else if ( ret == EAGAIN ){
+	continue;
+      } else {
+	fprintf(stderr, "read_post failed with code 0x%08lX: %s\n", ret, caputils_error_string(ret));
+      }
+    }
+
+    packets += spill_refill(con);
+    consumer_quiescent(con);
+    idle_round(&con->idle, con, packets);
+    if ( table->count == 0 ){
+      idle_sleep(&con->idle, con);
+    }
+  }
+
+  return 0;
+}
+
+void consumer_thread_attr_init(struct consumer_thread_attr* attr){
+  memset(attr, 0, sizeof(struct consumer_thread_attr));
+  attr->buffer_size = 1000 * sizeof(struct packet);
+  attr->merge_buffer_size = 1024 * 1024;
+  attr->merge_lateness.tv_psec = 100000000000; /* 100ms */
+  attr->idle_spin = 1000;
+  attr->idle_timeout = 10;
+  attr->overflow = CONSUMER_DROP_OLDEST;
+  attr->notify_interval = 1000;
+  attr->spill_segment_size = 64 * 1024 * 1024;
+  attr->spill_segments = 16;
+  attr->fair_buffer_size = 1024 * 1024;
+  attr->fair_quantum = 2048;
+  attr->numa_node = -1;
+  attr->reader_cpu = -1;
+  attr->tunnel_depth = CLASSIFY_TUNNEL_DEPTH;
+  attr->reassembly_memory = 4 * 1024 * 1024;
+  attr->reassembly_timeout = 30000;
+}
+
+static void shards_free(struct consumer_thread* con){
+  for ( unsigned int i = 0; i < con->shards; i++ ){
+    ring_free(&con->shard[i]);
+  }
+  free(con->shard);
+  free(con->shard_reader);
+  con->shards = 0;
+}
+
+/**
+ * Create the shard queues, each getting an equal part of the buffer size.
+ */
+static int shards_init(struct consumer_thread* con, unsigned int shards, size_t buffer_size){
+  if ( shards == 0 ){
+    return 0;
+  }
+
+  int ret;
+  if ( (ret=posix_memalign((void**)&con->shard, CACHE_LINE, shards * sizeof(struct ring))) != 0 ){
+    return ret;
+  }
+  if ( !(con->shard_reader = calloc(shards, sizeof(struct consumer_reader))) ){
+    free(con->shard);
+    return ENOMEM;
+  }
+
+  for ( unsigned int i = 0; i < shards; i++ ){
+    if ( (ret=ring_init_mem(&con->shard[i], buffer_size / shards, &con->mem)) != 0 ){
+      con->shards = i;
+      shards_free(con);
+      return ret;
+    }
+    con->shard[i].drop_func = (ring_drop_func)buffer_drop;
+    con->shard[i].drop_ctx = con;
+    con->shard_reader[i].con = con;
+    con->shard_reader[i].ring = &con->shard[i];
+    con->shard_reader[i].cursor = &con->shard[i].cursor[0];
+  }
+
+  con->shards = shards;
+  return 0;
+}
+
+int consumer_thread_init_attr(consumer_thread_t* conptr, const struct consumer_thread_attr* attr){
+  /* spilled packets would have to be routed to the shards when recovered */
+  if ( attr->shards > 0 && attr->overflow == CONSUMER_SPILL ){
+    return EINVAL;
+  }
+
+  /* fair mode replaces the buffer with the stream queues */
+  if ( attr->fair && (attr->merge || attr->broadcast || attr->shards > 0 || attr->shared || attr->overflow == CONSUMER_SPILL) ){
+    return EINVAL;
+  }
+
+  if ( attr->flow_hash != FLOW_HASH_CRC32C && attr->flow_hash != FLOW_HASH_TOEPLITZ ){
+    return EINVAL;
+  }
+
+  /* per-stream queue sizes (consumer_stream_attr) are checked when the streams are added */
+  if ( attr->buffer_size > RING_MAX_SIZE || attr->merge_buffer_size > RING_MAX_SIZE || attr->fair_buffer_size > RING_MAX_SIZE ){
+    return EINVAL;
+  }
+
+  consumer_thread_t con;
+  int ret;
+  if ( (ret=posix_memalign((void**)&con, CACHE_LINE, sizeof(struct consumer_thread))) != 0 ){
+    return ret;
+  }
+
+  /* everything released on error is either allocated or zero */
+  memset(con, 0, sizeof(struct consumer_thread));
+
+  con->mem.hugepages = attr->hugepages;
+  con->mem.lazy = attr->lazy;
+  con->mem.node = attr->numa_node;
+
+  /* with shards or in fair mode nothing is stored in the buffer itself */
+  if ( (ret=ring_init_mem(&con->ring, attr->shards > 0 || attr->fair ? 0 : attr->buffer_size, &con->mem)) != 0 ){
+    goto error;
+  }
+
+  if ( (ret=shards_init(con, attr->shards, attr->buffer_size)) != 0 ){
+    goto error;
+  }
+
+  ret = ENOMEM;
+  if ( !(con->table=calloc(1, sizeof(struct stream_table))) ){
+    goto error;
+  }
+
+  if ( attr->flow_hash == FLOW_HASH_TOEPLITZ ){
+    if ( !(con->toeplitz=malloc(sizeof(struct toeplitz))) ){
+      goto error;
+    }
+    toeplitz_init(con->toeplitz, attr->rss_key);
+  }
+
+  if ( attr->reassemble ){
+    if ( !(con->reasm=calloc(1, sizeof(struct reasm))) ){
+      goto error;
+    }
+    if ( (ret=reasm_init(con->reasm, attr->reassembly_memory, attr->reassembly_timeout, (reasm_emit_func)reasm_emit, con)) != 0 ){
+      goto error;
+    }
+  }
+
+  con->pkt_counter = 1;
+  con->delay = attr->delay;
+  con->merge = attr->merge;
+  con->merge_buffer_size = attr->merge_buffer_size;
+  con->merge_lateness = attr->merge_lateness;
+  con->idle_spin = attr->idle_spin;
+  con->idle_timeout = attr->idle_timeout;
+  con->overflow = attr->overflow;
+  con->notify = attr->notify ? attr->notify : default_notify;
+  con->notify_arg = attr->notify_arg;
+  con->notify_interval = attr->notify_interval * 1000000ULL;
+  con->fair = attr->fair;
+  con->fair_buffer_size = attr->fair_buffer_size;
+  con->fair_quantum = attr->fair_quantum > 0 ? attr->fair_quantum : 2048;
+  con->tunnel_depth = attr->tunnel_depth;
+  con->classify = attr->classify;
+  if ( con->overflow == CONSUMER_SPILL ){
+    const char* dir = attr->spill_dir ? attr->spill_dir : "/var/tmp";
+    if ( (ret=spill_init(&con->spill, dir, attr->spill_segment_size, attr->spill_segments)) != 0 ){
+      goto error;
+    }
+  }
+  con->reader.con = con;
+  con->reader.ring = &con->ring;
+  con->reader.cursor = &con->ring.cursor[0];
+  if ( attr->broadcast ){
+    ring_cursor_close(&con->ring, con->reader.cursor);
+    con->reader.cursor = NULL;
+  } else {
+    con->reader.cursor->shared = attr->shared;
+  }
+  con->reader.fair = attr->fair;
+  con->ring.drop_func = (ring_drop_func)buffer_drop;
+  con->ring.drop_ctx = con;
+  con->state = 1;
+  idle_init(&con->idle);
+
+  pthread_mutex_init(&con->table_mutex, NULL);
+
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  if ( attr->reader_cpu >= 0 ){
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(attr->reader_cpu, &cpus);
+    pthread_attr_setaffinity_np(&thread_attr, sizeof(cpu_set_t), &cpus);
+  }
+
+  ret = pthread_create(&con->thread, &thread_attr, (void* (*)(void*))consumer_thread_func, con);
+  pthread_attr_destroy(&thread_attr);
+  if ( ret != 0 ){
+    pthread_mutex_destroy(&con->table_mutex);
+    goto error;
+  }
+
+  *conptr = con;
+  return 0;
+
+error:
+  spill_free(&con->spill);
+  if ( con->reasm ){
+    reasm_free(con->reasm);
+    free(con->reasm);
+  }
+  free(con->toeplitz);
+  free(con->table);
+  shards_free(con);
+  ring_free(&con->ring);
+  free(con);
+  return ret;
+}
+
+int consumer_thread_init(consumer_thread_t* conptr, size_t buffer_size, const timepico* delay){
+  struct consumer_thread_attr attr;
+  consumer_thread_attr_init(&attr);
+  attr.buffer_size = buffer_size * sizeof(struct packet);
+  if ( delay ){
+    attr.delay.tv_sec  = delay->tv_sec;
+    attr.delay.tv_psec = delay->tv_psec;
+  }
+  return consumer_thread_init_attr(conptr, &attr);
+}
+
+/**
+ * Publish a new stream table (table_mutex must be held). The old table is
+ * freed once the consumer thread has passed a quiescent state (and in fair
+ * mode the polling thread has left the poll epoch), which is only
+ * waited for when synchronize is set: with CONSUMER_BLOCK the consumer thread
+ * may be stuck on a full buffer for as long as nobody reads it.
+ */
+static void replace_table(struct consumer_thread* con, struct stream_table* table, int synchronize){
+  struct stream_table* old = __atomic_exchange_n(&con->table, table, __ATOMIC_SEQ_CST);
+  old->quiescent = __atomic_load_n(&con->quiescent, __ATOMIC_SEQ_CST);
+  old->poll_epoch = __atomic_load_n(&con->poll_epoch, __ATOMIC_SEQ_CST);
+  old->retired = con->retired;
+  con->retired = old;
+
+  if ( synchronize ){
+    consumer_synchronize(con);
+    poll_synchronize(con);
+  }
+
+  const uint64_t quiescent = __atomic_load_n(&con->quiescent, __ATOMIC_SEQ_CST);
+  const uint64_t poll_epoch = __atomic_load_n(&con->poll_epoch, __ATOMIC_SEQ_CST);
+  struct stream_table** cur = &con->retired;
+  while ( *cur ){
+    struct stream_table* retired = *cur;
+    if ( retired->quiescent != quiescent && (!(retired->poll_epoch & 1) || retired->poll_epoch != poll_epoch) ){
+      *cur = retired->retired;
+      free(retired);
+    } else {
+      cur = &retired->retired;
+    }
+  }
+}
+
+/**
+ * Find a stream in the current table. Ids are assigned in increasing order and
+ * the table keeps the order, so the slots are sorted by id.
+ */
+static struct stream_slot* find_slot(const struct consumer_thread* con, int stream_id){
+  const struct stream_table* table = __atomic_load_n(&con->table, __ATOMIC_ACQUIRE);
+  size_t lo = 0;
+  size_t hi = table->count;
+  while ( lo < hi ){
+    const size_t mid = lo + (hi - lo) / 2;
+    if ( table->slot[mid]->id < stream_id ){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < table->count && table->slot[lo]->id == stream_id ? table->slot[lo] : NULL;
+}
+
+static void free_slot(struct stream_slot* slot){
+  stream_close(slot->stream);
+  if ( slot->con ){
+    ring_free(&slot->queue);
+  }
+  free(slot);
+}
+
+long consumer_thread_add_stream(consumer_thread_t con, const stream_addr_t* src, const char* nic, int port, struct filter* filter){
+  return consumer_thread_add_stream_attr(con, src, nic, port, filter, NULL);
+}
+
+long consumer_thread_add_stream_attr(consumer_thread_t con, const stream_addr_t* src, const char* nic, int port, struct filter* filter, const struct consumer_stream_attr* attr){
+  struct stream* st;
+  long ret;
+  if( (ret=stream_open(&st, src, nic, port)) != 0 ) {
+    return ret;
+  }
+
+  struct stream_slot* slot = calloc(1, sizeof(struct stream_slot));
+  if ( !slot ){
+    stream_close(st);
+    return ENOMEM;
+  }
+  slot->stream = st;
+  slot->filter = filter;
+  slot->weight = attr && attr->weight > 0 ? attr->weight : 1;
+
+  pthread_mutex_lock(&con->table_mutex);
+
+  /* stream_id is only 16 bits wide */
+  if ( con->next_id > 0xFFFF ){
+    pthread_mutex_unlock(&con->table_mutex);
+    free_slot(slot);
+    return ENOSPC;
+  }
+  slot->id = con->next_id;
+
+  const struct stream_table* old = con->table;
+  struct stream_table* table = malloc(sizeof(struct stream_table) + (old->count + 1) * sizeof(struct stream_slot*));
+  if ( !table ){
+    pthread_mutex_unlock(&con->table_mutex);
+    free_slot(slot);
+    return ENOMEM;
+  }
+
+  if ( con->merge || con->fair ){
+    size_t size = con->merge ? con->merge_buffer_size : con->fair_buffer_size;
+    if ( attr && attr->buffer_size > 0 ){
+      size = attr->buffer_size;
+    }
+    if ( (ret=ring_init_mem(&slot->queue, size, &con->mem)) != 0 ){
+      pthread_mutex_unlock(&con->table_mutex);
+      free(table);
+      free_slot(slot);
+      return ret;
+    }
+    slot->con = con;
+    slot->queue.drop_func = (ring_drop_func)queue_drop;
+    slot->queue.drop_ctx = slot;
+  }
+
+  if ( con->merge ){
+    idle_init(&slot->idle);
+    if ( (ret=pthread_create(&slot->thread, NULL, (void* (*)(void*))stream_reader_func, slot)) != 0 ){
+      pthread_mutex_unlock(&con->table_mutex);
+      free(table);
+      free_slot(slot);
+      return ret;
+    }
+  }
+
+  memcpy(table->slot, old->slot, old->count * sizeof(struct stream_slot*));
+  table->slot[old->count] = slot;
+  table->count = old->count + 1;
+  con->next_id++;
+  replace_table(con, table, 0);
+
+  pthread_mutex_unlock(&con->table_mutex);
+  return 0;
+}
+
+/**
+ * Stop reading from a stream and wait for its packets to reach the buffer.
+ * table_mutex must be held.
+ */
+static void drain_slot(struct consumer_thread* con, struct stream_slot* slot){
+  __atomic_store_n(&slot->removed, 1, __ATOMIC_SEQ_CST);
+
+  if ( con->merge ){
+    pthread_join(slot->thread, NULL);
+
+    /* let the merge emit whatever is left in the queue */
+    const struct timespec ts = {0, 100000};
+    while ( con->state == 1 && (ring_pending(&slot->queue, &slot->queue.cursor[0]) > 0 || __atomic_load_n(&slot->held, __ATOMIC_ACQUIRE)) ){
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  if ( con->fair ){
+    /* once the consumer thread is done with the stream, wait for the polling
+     * thread to read the rest of the queue */
+    consumer_synchronize(con);
+    const struct timespec ts = {0, 100000};
+    while ( con->state == 1 && ring_pending(&slot->queue, &slot->queue.cursor[0]) > 0 ){
+      nanosleep(&ts, NULL);
+    }
+  }
+}
+
+int consumer_thread_remove_stream(consumer_thread_t con, int stream_id){
+  pthread_mutex_lock(&con->table_mutex);
+
+  struct stream_slot* slot = find_slot(con, stream_id);
+  if ( !slot ){
+    pthread_mutex_unlock(&con->table_mutex);
+    return ENOENT;
+  }
+
+  const struct stream_table* old = con->table;
+  struct stream_table* table = malloc(sizeof(struct stream_table) + old->count * sizeof(struct stream_slot*));
+  if ( !table ){
+    pthread_mutex_unlock(&con->table_mutex);
+    return ENOMEM;
+  }
+
+  drain_slot(con, slot);
+
+  table->count = 0;
+  for ( size_t i = 0; i < old->count; i++ ){
+    if ( old->slot[i] != slot ){
+      table->slot[table->count++] = old->slot[i];
+    }
+  }
+  replace_table(con, table, 1);
+  classify_stats_add(&con->classify_removed, &slot->classify);
+  free_slot(slot);
+
+  pthread_mutex_unlock(&con->table_mutex);
+  return 0;
+}
+
+int consumer_thread_set_idle(consumer_thread_t con, unsigned int spin, unsigned int timeout){
+  __atomic_store_n(&con->idle_spin, spin, __ATOMIC_RELAXED);
+  __atomic_store_n(&con->idle_timeout, timeout, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void idle_stats(const struct idle* idle, const struct timespec* now, struct consumer_thread_stats* stats){
+  const uint64_t elapsed = timespec_diff_ns(&idle->started, now);
+  const uint64_t idle_ns = __atomic_load_n(&idle->idle_ns, __ATOMIC_RELAXED);
+  stats->idle_time += idle_ns;
+  stats->busy_time += elapsed > idle_ns ? elapsed - idle_ns : 0;
+}
+
+/**
+ * Unread packets of the slowest reader.
+ */
+static size_t buffer_pending(struct ring* ring){
+  const uint32_t active = __atomic_load_n(&ring->active, __ATOMIC_ACQUIRE);
+  size_t pending = 0;
+  for ( int i = 0; i < RING_MAX_CURSORS; i++ ){
+    if ( active & (1U << i) ){
+      const size_t n = ring_pending(ring, &ring->cursor[i]);
+      pending = n > pending ? n : pending;
+    }
+  }
+  return pending;
+}
+
+void consumer_thread_stats(consumer_thread_t con, struct consumer_thread_stats* stats){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  memset(stats, 0, sizeof(struct consumer_thread_stats));
+
+  pthread_mutex_lock(&con->table_mutex);
+  {
+    idle_stats(&con->idle, &now, stats);
+    if ( con->merge ){
+      for ( size_t i = 0; i < con->table->count; i++ ){
+	idle_stats(&con->table->slot[i]->idle, &now, stats);
+      }
+    }
+    if ( con->fair ){
+      for ( size_t i = 0; i < con->table->count; i++ ){
+	struct ring* queue = &con->table->slot[i]->queue;
+	stats->packets += __atomic_load_n(&queue->write_count, __ATOMIC_RELAXED);
+	stats->pending += ring_pending(queue, &queue->cursor[0]);
+      }
+    }
+    stats->streams = con->table->count;
+  }
+  pthread_mutex_unlock(&con->table_mutex);
+
+  stats->packets += __atomic_load_n(&con->ring.write_count, __ATOMIC_RELAXED);
+  stats->pending += buffer_pending(&con->ring);
+  for ( unsigned int i = 0; i < con->shards; i++ ){
+    stats->packets += __atomic_load_n(&con->shard[i].write_count, __ATOMIC_RELAXED);
+    stats->pending += buffer_pending(&con->shard[i]);
+  }
+  stats->late    = __atomic_load_n(&con->late_count, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&con->drop_count, __ATOMIC_RELAXED);
+  stats->dropped_bytes = __atomic_load_n(&con->drop_bytes, __ATOMIC_RELAXED);
+  stats->spilled = __atomic_load_n(&con->spill.spilled, __ATOMIC_RELAXED);
+  stats->recovered = __atomic_load_n(&con->spill.recovered, __ATOMIC_RELAXED);
+  stats->pending += stats->spilled - stats->recovered;
+}
+
+int consumer_thread_reassembly_stats(consumer_thread_t con, struct consumer_reassembly_stats* stats){
+  memset(stats, 0, sizeof(struct consumer_reassembly_stats));
+
+  const struct reasm* r = con->reasm;
+  if ( !r ){
+    return EINVAL;
+  }
+
+  stats->fragments    = __atomic_load_n(&r->fragments, __ATOMIC_RELAXED);
+  stats->reassembled  = __atomic_load_n(&r->reassembled, __ATOMIC_RELAXED);
+  stats->timeouts     = __atomic_load_n(&r->timeouts, __ATOMIC_RELAXED);
+  stats->evicted      = __atomic_load_n(&r->evicted, __ATOMIC_RELAXED);
+  stats->rejected     = __atomic_load_n(&r->rejected, __ATOMIC_RELAXED);
+  stats->pending      = __atomic_load_n(&r->pending, __ATOMIC_RELAXED);
+  stats->memory       = reasm_memory(__atomic_load_n(&r->held, __ATOMIC_RELAXED));
+  stats->memory_peak  = reasm_memory(__atomic_load_n(&r->held_peak, __ATOMIC_RELAXED));
+  stats->memory_limit = reasm_memory(r->max_frags);
+  return 0;
+}
+
+int consumer_thread_stream_stats(consumer_thread_t con, int stream_id, struct consumer_stream_stats* stats){
+  pthread_mutex_lock(&con->table_mutex);
+  struct stream_slot* slot = find_slot(con, stream_id);
+  if ( slot ){
+    memset(stats, 0, sizeof(struct consumer_stream_stats));
+    stats->dropped = __atomic_load_n(&slot->dropped, __ATOMIC_RELAXED);
+    stats->dropped_bytes = __atomic_load_n(&slot->dropped_bytes, __ATOMIC_RELAXED);
+    stats->weight = __atomic_load_n(&slot->weight, __ATOMIC_RELAXED);
+    if ( slot->con ){
+      stats->queued = ring_pending(&slot->queue, &slot->queue.cursor[0]);
+      stats->queued_bytes = ring_lag(&slot->queue, &slot->queue.cursor[0]);
+      stats->capacity = slot->queue.size;
+    }
+  }
+  pthread_mutex_unlock(&con->table_mutex);
+  return slot ? 0 : ENOENT;
+}
+
+int consumer_thread_classify_stats(consumer_thread_t con, int stream_id, struct classify_stats* stats){
+  memset(stats, 0, sizeof(struct classify_stats));
+
+  pthread_mutex_lock(&con->table_mutex);
+  struct stream_slot* slot = NULL;
+  if ( stream_id < 0 ){
+    classify_stats_add(stats, &con->classify_removed);
+    for ( size_t i = 0; i < con->table->count; i++ ){
+      classify_stats_add(stats, &con->table->slot[i]->classify);
+    }
+  } else if ( (slot=find_slot(con, stream_id)) ){
+    classify_stats_add(stats, &slot->classify);
+  }
+  pthread_mutex_unlock(&con->table_mutex);
+  return stream_id < 0 || slot ? 0 : ENOENT;
+}
+
+int consumer_thread_set_snaplen(consumer_thread_t con, int stream_id, size_t snaplen){
+  pthread_mutex_lock(&con->table_mutex);
+  struct stream_slot* slot = find_slot(con, stream_id);
+  if ( slot ){
+    slot->snaplen = snaplen;
+  }
+  pthread_mutex_unlock(&con->table_mutex);
+  return slot ? 0 : ENOENT;
+}
+
+int consumer_thread_set_weight(consumer_thread_t con, int stream_id, unsigned int weight){
+  if ( weight == 0 ){
+    return EINVAL;
+  }
+
+  pthread_mutex_lock(&con->table_mutex);
+  struct stream_slot* slot = find_slot(con, stream_id);
+  if ( slot ){
+    __atomic_store_n(&slot->weight, weight, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&con->table_mutex);
+  return slot ? 0 : ENOENT;
+}
+
+int consumer_thread_destroy(consumer_thread_t con){
+  pthread_mutex_lock(&con->table_mutex);
+  struct stream_table* table = con->table;
+
+  /* nobody will read the remaining packets so the streams are not drained,
+   * stopping first also releases threads blocked on a full buffer */
+  con->state = 0;
+  for ( size_t i = 0; i < table->count; i++ ){
+    drain_slot(con, table->slot[i]);
+  }
+  pthread_join(con->thread, NULL);
+
+  for ( size_t i = 0; i < table->count; i++ ){
+    free_slot(table->slot[i]);
+  }
+  free(table);
+  while ( con->retired ){
+    struct stream_table* retired = con->retired;
+    con->retired = retired->retired;
+    free(retired);
+  }
+  pthread_mutex_unlock(&con->table_mutex);
+
+  pthread_mutex_destroy(&con->table_mutex);
+  ring_free(&con->ring);
+  shards_free(con);
+  if ( con->overflow == CONSUMER_SPILL ){
+    spill_free(&con->spill);
+  }
+  free(con->toeplitz);
+  if ( con->reasm ){
+    reasm_free(con->reasm);
+    free(con->reasm);
+  }
+  free(con);
+  return 0;
+}
+
+static void timespec_add_ns(struct timespec* ts, uint64_t ns){
+  ts->tv_sec  += ns / 1000000000;
+  ts->tv_nsec += ns % 1000000000;
+  if ( ts->tv_nsec >= 1000000000 ){
+    ts->tv_sec += 1;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/**
+ * Milliseconds left until a CLOCK_MONOTONIC deadline, rounded up.
+ */
+static unsigned int timespec_left_ms(const struct timespec* deadline){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const int64_t ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 + (deadline->tv_nsec - now.tv_nsec);
+  return ns > 0 ? (ns + 999999) / 1000000 : 0;
+}
+
+/**
+ * Sleep until a packet is due. Packet time is wall time, so it is mapped to
+ * CLOCK_MONOTONIC (which the deadline is in) to sleep on an absolute time
+ * unaffected by clock adjustments. Returns zero if the deadline came first.
+ */
+static int sleep_until(const timepico* due, const struct timespec* deadline){
+  struct timespec real, wake;
+  clock_gettime(CLOCK_REALTIME, &real);
+  clock_gettime(CLOCK_MONOTONIC, &wake);
+
+  const int64_t ns = ((int64_t)due->tv_sec - real.tv_sec) * 1000000000 + ((int64_t)(due->tv_psec / 1000) - real.tv_nsec);
+  if ( ns > 0 ){
+    timespec_add_ns(&wake, ns);
+  }
+
+  const int timeout = wake.tv_sec > deadline->tv_sec || (wake.tv_sec == deadline->tv_sec && wake.tv_nsec > deadline->tv_nsec);
+  if ( timeout ){
+    wake = *deadline;
+  }
+
+  while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR );
+  return !timeout;
+}
+
+/**
+ * Unread packets in all stream queues. The caller must be in the poll epoch.
+ */
+static size_t fair_pending(const struct stream_table* table){
+  size_t pending = 0;
+  for ( size_t i = 0; i < table->count; i++ ){
+    struct ring* queue = &table->slot[i]->queue;
+    pending += ring_pending(queue, &queue->cursor[0]);
+  }
+  return pending;
+}
+
+/**
+ * Deficit round-robin over the stream queues: a stream is given its quantum
+ * times weight bytes when its turn comes and is served for as long as the
+ * deficit covers the next packet, also across calls. An empty stream loses
+ * its deficit. Claims up to n due packets from the stream being served and
+ * points the default reader at its queue. If nothing is due but packets are
+ * delayed, delayed is set along with the earliest head timestamp.
+ */
+static uint64_t fair_pick(struct consumer_thread* con, const struct stream_table* table, size_t n, const timepico* now, size_t* count, timepico* due, int* delayed){
+  *count = 0;
+  *delayed = 0;
+
+  /* stop after a whole round in which no stream had packets due */
+  size_t idle = 0;
+  while ( idle < table->count ){
+    if ( con->drr_index >= table->count ){
+      con->drr_index = 0;
+      con->drr_visit = 0;
+    }
+
+    struct stream_slot* slot = table->slot[con->drr_index];
+    struct ring* queue = &slot->queue;
+    struct ring_cursor* cursor = &queue->cursor[0];
+    if ( !con->drr_visit ){
+      slot->deficit += con->fair_quantum * __atomic_load_n(&slot->weight, __ATOMIC_RELAXED);
+      con->drr_visit = 1;
+    }
+
+    size_t due_count;
+    const uint64_t read_pos = ring_claim(queue, cursor, n, now, &due_count);
+    size_t i = 0;
+    uint64_t pos = read_pos;
+    while ( i < due_count ){
+      const size_t size = ring_record_size(ring_at(queue, pos)->caphead.caplen);
+      if ( size > slot->deficit ){
+	break;
+      }
+      slot->deficit -= size;
+      pos += size;
+      i++;
+    }
+
+    if ( i > 0 ){
+      con->reader.ring = queue;
+      con->reader.cursor = cursor;
+      *count = i;
+      return read_pos;
+    }
+
+    if ( due_count > 0 ){
+      /* not enough credit left, let go of the busy mark and wait for the next turn */
+      ring_release(queue, cursor, read_pos, 0);
+      idle = 0;
+    } else {
+      timepico ts;
+      if ( ring_head_time(queue, cursor, &ts) ){
+	if ( !*delayed || timecmp(&ts, due) < 0 ){
+	  *due = ts;
+	}
+	*delayed = 1;
+      } else {
+	slot->deficit = 0;
+      }
+      idle++;
+    }
+
+    con->drr_index++;
+    con->drr_visit = 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Fair mode version of reader_claim(). When packets are claimed the caller is
+ * left in the poll epoch, until they are handed back (see reader_done()).
+ */
+static uint64_t fair_claim(struct consumer_thread* con, size_t n, unsigned int timeout, size_t* count, size_t* remaining){
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  timespec_add_ns(&deadline, timeout * 1000000ULL);
+
+  for (;;){
+    const uint32_t seq = __atomic_load_n(&con->bell.seq, __ATOMIC_SEQ_CST);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timepico tp = timespec_to_timepico(ts);
+
+    poll_enter(con);
+    const struct stream_table* table = __atomic_load_n(&con->table, __ATOMIC_SEQ_CST);
+    timepico due;
+    int delayed;
+    const uint64_t read_pos = fair_pick(con, table, n, &tp, count, &due, &delayed);
+    if ( *count > 0 ){
+      if ( remaining ){
+	const size_t pending = fair_pending(table);
+	*remaining = pending > *count ? pending - *count : 0;
+      }
+      return read_pos;
+    }
+    poll_leave(con);
+
+    /* the oldest packet is delayed, sleep until it is due (or the timeout) */
+    if ( delayed ){
+      if ( !sleep_until(&due, &deadline) ){
+	return 0;
+      }
+      continue;
+    }
+
+    const unsigned int left = timespec_left_ms(&deadline);
+    if ( left == 0 ){
+      return 0;
+    }
+    ring_bell_wait(&con->bell, seq, left);
+  }
+}
+
+/**
+ * Called when the packets claimed by a reader have been handed back.
+ */
+static void reader_done(struct consumer_reader* reader){
+  if ( reader->fair ){
+    poll_leave(reader->con);
+  }
+}
+
+/**
+ * Wait for packets and claim up to n of those which are due. If the oldest
+ * packet is not due yet the caller sleeps until it is.
+ */
+static uint64_t reader_claim(struct consumer_reader* reader, size_t n, unsigned int timeout, size_t* count, size_t* remaining){
+  struct ring* ring = reader->ring;
+  *count = 0;
+  if ( remaining ){
+    *remaining = 0;
+  }
+
+  if ( reader->fair ){
+    return fair_claim(reader->con, n, timeout, count, remaining);
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  timespec_add_ns(&deadline, timeout * 1000000ULL);
+
+  uint64_t read_pos;
+  for (;;){
+    if ( !ring_wait(ring, reader->cursor, timespec_left_ms(&deadline)) ){
+      return 0;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timepico tp = timespec_to_timepico(ts);
+
+    if ( reader->cursor->shared ){
+      read_pos = ring_claim_shared(ring, reader->cursor, n, &tp, count);
+    } else {
+      read_pos = ring_claim(ring, reader->cursor, n, &tp, count);
+    }
+    if ( *count > 0 ){
+      break;
+    }
+
+    /* the oldest packet is delayed, sleep until it is due (or the timeout) */
+    timepico due;
+    if ( ring_head_time(ring, reader->cursor, &due) && !sleep_until(&due, &deadline) ){
+      return 0;
+    }
+  }
+
+  if ( remaining ){
+    const size_t pending = ring_pending(ring, reader->cursor);
+    *remaining = pending > *count ? pending - *count : 0;
+  }
+
+  return read_pos;
+}
+
+int consumer_reader_open(consumer_thread_t con, consumer_reader_t* readerptr, int oldest){
+  if ( con->fair ){
+    return EINVAL;
+  }
+
+  struct consumer_reader* reader = calloc(1, sizeof(struct consumer_reader));
+  if ( !reader ){
+    return ENOMEM;
+  }
+
+  pthread_mutex_lock(&con->table_mutex);
+  reader->con = con;
+  reader->ring = &con->ring;
+  reader->cursor = ring_cursor_open(&con->ring, oldest);
+  pthread_mutex_unlock(&con->table_mutex);
+
+  if ( !reader->cursor ){
+    free(reader);
+    return EBUSY;
+  }
+
+  *readerptr = reader;
+  return 0;
+}
+
+void consumer_reader_close(consumer_reader_t reader){
+  struct consumer_thread* con = reader->con;
+  pthread_mutex_lock(&con->table_mutex);
+  ring_cursor_close(&con->ring, reader->cursor);
+  pthread_mutex_unlock(&con->table_mutex);
+  free(reader);
+}
+
+void consumer_reader_stats(consumer_reader_t reader, struct consumer_reader_stats* stats){
+  const struct ring_cursor* cursor = reader->cursor;
+  stats->read      = __atomic_load_n(&cursor->read_count, __ATOMIC_RELAXED);
+  stats->dropped   = __atomic_load_n(&cursor->drop_count, __ATOMIC_RELAXED);
+  stats->lag       = ring_pending(reader->ring, cursor);
+  stats->lag_bytes = ring_lag(reader->ring, cursor);
+}
+
+size_t consumer_reader_acquire_batch(consumer_reader_t reader, const struct packet** pkt, size_t n, unsigned int timeout, size_t* remaining){
+  size_t count;
+  uint64_t pos = reader_claim(reader, n, timeout, &count, remaining);
+  const struct ring* ring = reader->ring; /* in fair mode set by the claim */
+  for ( size_t i = 0; i < count; i++ ){
+    pkt[i] = ring_at(ring, pos);
+    pos = ring_next(ring, pos);
+  }
+  return count;
+}
+
+void consumer_reader_release_batch(consumer_reader_t reader, size_t n){
+  struct ring* ring = reader->ring;
+  uint64_t pos = reader->cursor->read_pos & ~RING_BUSY;
+  assert(!reader->cursor->shared);
+  assert(reader->cursor->read_pos & RING_BUSY);
+
+  for ( size_t i = 0; i < n; i++ ){
+    pos = ring_next(ring, pos);
+  }
+  ring_release(ring, reader->cursor, pos, n);
+  reader_done(reader);
+}
+
+const struct packet* consumer_reader_acquire(consumer_reader_t reader, unsigned int timeout){
+  const struct packet* pkt;
+  if ( consumer_reader_acquire_batch(reader, &pkt, 1, timeout, NULL) == 0 ){
+    return NULL;
+  }
+  return pkt;
+}
+
+void consumer_reader_release(consumer_reader_t reader, const struct packet* pkt){
+  consumer_reader_release_packets(reader, &pkt, 1);
+}
+
+void consumer_reader_release_packets(consumer_reader_t reader, const struct packet** pkt, size_t n){
+  if ( !reader->cursor->shared ){
+    assert(n == 0 || pkt[0] == ring_at(reader->ring, reader->cursor->read_pos & ~RING_BUSY));
+    consumer_reader_release_batch(reader, n);
+    return;
+  }
+
+  for ( size_t i = 0; i < n; i++ ){
+    ring_mark_done(pkt[i]);
+  }
+  ring_advance(reader->ring, reader->cursor);
+}
+
+/**
+ * Cut a packet to caplen bytes and classify it again, with the classifier of
+ * con (as when it was stored) or without con the generic one.
+ */
+static void truncate_packet(const struct consumer_thread* con, struct packet* pkt, size_t caplen){
+  if ( pkt->caphead.caplen <= caplen ){
+    return;
+  }
+
+  const uint32_t ingest = pkt->info.type & (PACKET_FRAGMENT | PACKET_REASSEMBLED);
+  pkt->caphead.caplen = caplen;
+  if ( con ){
+    ingest_classify_frame(con, pkt->buf, caplen, &pkt->info);
+  } else {
+    classify_frame(pkt->buf, caplen, &pkt->info, pkt->info.depth);
+  }
+  pkt->info.type |= ingest;
+}
+
+void packet_truncate(struct packet* pkt, size_t caplen){
+  assert(pkt);
+  truncate_packet(NULL, pkt, caplen);
+}
+
+/**
+ * Copy a record into a struct packet, truncating it to MAX_CAPTURE_SIZE.
+ */
+static void copy_packet(const struct consumer_thread* con, struct packet* dst, const struct packet* src){
+  static const size_t buffer_offset = offsetof(struct packet, buf);
+  const size_t len = min(src->caphead.caplen, MAX_CAPTURE_SIZE);
+  memcpy(dst, src, buffer_offset + len);
+  truncate_packet(con, dst, len);
+}
+
+int consumer_reader_poll(consumer_reader_t reader, struct packet* pkt, unsigned int timeout){
+  const struct packet* tmp = consumer_reader_acquire(reader, timeout);
+  if ( !tmp ){
+    return 0;
+  }
+
+  copy_packet(reader->con, pkt, tmp);
+  consumer_reader_release(reader, tmp);
+  return 1;
+}
+
+size_t consumer_reader_poll_batch(consumer_reader_t reader, struct packet* pkt, size_t n, unsigned int timeout, size_t* remaining){
+  size_t count;
+  uint64_t pos = reader_claim(reader, n, timeout, &count, remaining);
+  if ( count == 0 ){
+    return 0;
+  }
+
+  struct ring* ring = reader->ring; /* in fair mode set by the claim */
+
+  if ( reader->cursor->shared ){
+    for ( size_t i = 0; i < count; i++ ){
+      const struct packet* src = ring_at(ring, pos);
+      pos = ring_next(ring, pos);
+      copy_packet(reader->con, &pkt[i], src);
+      ring_mark_done(src);
+    }
+    ring_advance(ring, reader->cursor);
+    return count;
+  }
+
+  for ( size_t i = 0; i < count; i++ ){
+    copy_packet(reader->con, &pkt[i], ring_at(ring, pos));
+    pos = ring_next(ring, pos);
+  }
+
+  ring_release(ring, reader->cursor, pos, count);
+  reader_done(reader);
+  return count;
+}
+
+size_t consumer_reader_poll_tuples(consumer_reader_t reader, struct packet_tuples* t, unsigned int timeout, size_t* remaining){
+  const size_t count = consumer_reader_acquire_batch(reader, t->pkt, t->capacity, timeout, remaining);
+  packet_tuples_extract(t, t->pkt, count);
+  if ( count > 0 ){
+    consumer_reader_release_packets(reader, t->pkt, count);
+  }
+  return count;
+}
+
+size_t consumer_thread_acquire_batch(consumer_thread_t con, const struct packet** pkt, size_t n, unsigned int timeout, size_t* remaining){
+  assert(con->reader.cursor);
+  return consumer_reader_acquire_batch(&con->reader, pkt, n, timeout, remaining);
+}
+
+void consumer_thread_release_batch(consumer_thread_t con, size_t n){
+  consumer_reader_release_batch(&con->reader, n);
+}
+
+const struct packet* consumer_thread_acquire(consumer_thread_t con, unsigned int timeout){
+  assert(con->reader.cursor);
+  return consumer_reader_acquire(&con->reader, timeout);
+}
+
+void consumer_thread_release(consumer_thread_t con, const struct packet* pkt){
+  consumer_reader_release(&con->reader, pkt);
+}
+
+void consumer_thread_release_packets(consumer_thread_t con, const struct packet** pkt, size_t n){
+  consumer_reader_release_packets(&con->reader, pkt, n);
+}
+
+int consumer_thread_poll(consumer_thread_t con, struct packet* pkt, unsigned int timeout){
+  assert(con->reader.cursor);
+  return consumer_reader_poll(&con->reader, pkt, timeout);
+}
+
+size_t consumer_thread_poll_batch(consumer_thread_t con, struct packet* pkt, size_t n, unsigned int timeout, size_t* remaining){
+  assert(con->reader.cursor);
+  return consumer_reader_poll_batch(&con->reader, pkt, n, timeout, remaining);
+}
+
+size_t consumer_thread_poll_tuples(consumer_thread_t con, struct packet_tuples* t, unsigned int timeout, size_t* remaining){
+  assert(con->reader.cursor);
+  return consumer_reader_poll_tuples(&con->reader, t, timeout, remaining);
+}
+
+int consumer_thread_pending(consumer_thread_t con){
+  assert(con->reader.cursor);
+  if ( con->fair ){
+    /* may be called with packets borrowed, i.e. already in the poll epoch */
+    const int inside = __atomic_load_n(&con->poll_epoch, __ATOMIC_RELAXED) & 1;
+    if ( !inside ){
+      poll_enter(con);
+    }
+    const size_t pending = fair_pending(__atomic_load_n(&con->table, __ATOMIC_SEQ_CST));
+    if ( !inside ){
+      poll_leave(con);
+    }
+    return (int)pending;
+  }
+  return (int)ring_pending(&con->ring, con->reader.cursor);
+}
+
+consumer_reader_t consumer_thread_shard(consumer_thread_t con, unsigned int shard){
+  return shard < con->shards ? &con->shard_reader[shard] : NULL;
+}
+
+size_t consumer_thread_shard_depth(consumer_thread_t con, unsigned int shard){
+  return shard < con->shards ? ring_pending(&con->shard[shard], &con->shard[shard].cursor[0]) : 0;
+}
+
+int consumer_pin_thread(int cpu){
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+}
+
+void consumer_lock(consumer_thread_t con){
+  /* deprecated */
+}
+
+void consumer_unlock(consumer_thread_t con){
+  /* deprecated */
+}
+
+struct packet* consumer_buffer_get(consumer_thread_t con, unsigned int index){
+  if ( con->fair || !con->reader.cursor ){
+    return NULL;
+  }
+
+  const struct ring* ring = &con->ring;
+  const uint64_t write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+  uint64_t pos = __atomic_load_n(&con->reader.cursor->read_pos, __ATOMIC_ACQUIRE) & ~RING_BUSY;
+
+  while ( pos < write_pos ){
+    if ( index-- == 0 ){
+      return ring_at(ring, pos);
+    }
+    pos = ring_next(ring, pos);
+  }
+
+  return NULL;
 }
@@ -18,12 +18,63 @@ struct llc_pdu_sn {
 
 
 
+/**
+ * Tunnel types, see frame_info.tunnel.
+ */
+enum frame_tunnel {
+  FRAME_TUNNEL_NONE = 0,
+  FRAME_TUNNEL_GRE,        /* IP protocol 47, IPv4, IPv6 or ethernet payload */
+  FRAME_TUNNEL_VXLAN,      /* UDP port 4789 */
+  FRAME_TUNNEL_GTPU,       /* UDP port 2152 */
+  FRAME_TUNNEL_IPIP,       /* IPv4 or IPv6 in IPv4 or IPv6 */
+
+  FRAME_TUNNEL_MAX
+};
+
+/* default number of tunnels decapsulated */
+#define CLASSIFY_TUNNEL_DEPTH 4
+
+/**
+ * Classification of a frame as offsets from the start of the frame
+ * (caphead.payload), so it stays valid when the packet is copied or moved.
+ * An offset is 0 when the header isn't present; a header is only recorded if
+ * it is fully captured.
+ */
+struct frame_info {
+  uint32_t type;           /* enum packet_type_t bitmask */
+  uint16_t ethertype;      /* type of the layer 3 header, after vlan tags and mpls labels */
+  uint8_t proto;           /* IP protocol or last IPv6 next header, if type has PACKET_IP or PACKET_IPV6 */
+  uint8_t result;          /* enum classify_result */
+  uint16_t l3_offset;      /* IPv4, IPv6 or ARP header */
+  uint16_t l4_offset;      /* TCP, UDP, ICMP or ICMPv6 header, or the ARP request */
+  uint16_t payload_offset; /* data after the TCP or UDP header (at most caplen) */
+  uint8_t tags;            /* number of vlan tags (802.1Q and 802.1ad), see frame_vlan_tci() */
+  uint8_t labels;          /* number of mpls labels, see frame_mpls_label() */
+
+  /* Tunnelled frames (type has PACKET_TUNNEL): the fields above describe the
+   * innermost packet, the outer fields the outermost IP layer. */
+  uint16_t outer_l3_offset; /* outer IPv4 or IPv6 header */
+  uint16_t outer_l4_offset; /* outer UDP (VXLAN, GTP-U) or GRE header, 0 for IP-in-IP */
+  uint8_t tunnel;           /* enum frame_tunnel of the outermost tunnel */
+  uint8_t depth;            /* number of tunnels decapsulated */
+  uint16_t reserved;
+};
+
+/**
+ * Packets are stored in the consumer buffer as variable-length records with
+ * only caphead.caplen bytes of buf present. A packet borrowed from the buffer
+ * (consumer_thread_acquire()) may therefore be both shorter and longer than
+ * MAX_CAPTURE_SIZE, while a copied packet (consumer_thread_poll()) is truncated
+ * to MAX_CAPTURE_SIZE.
+ */
 struct packet {
   uint16_t used;
   uint16_t stream_id;
   uint32_t packet_id;
+  uint32_t hash;          /* flow hash, see consumer_thread_attr.flow_hash */
+  struct frame_info info; /* classified when the packet was read */
   struct cap_header caphead;
-  char buf[MAX_CAPTURE_SIZE]; /* this should be determined by looking at the stream header and it's caplen */
+  char buf[MAX_CAPTURE_SIZE];
 };
 
 enum packet_type_t {
@@ -33,6 +84,11 @@ enum packet_type_t {
 
   TRANSPORT_TCP = (1<<3),
   TRANSPORT_UDP = (1<<4),
+
+  PACKET_IPV6 = (1<<5), /* PACKET_ICMP is also used for ICMPv6 */
+  PACKET_TUNNEL = (1<<6), /* the other bits describe the innermost packet */
+  PACKET_FRAGMENT = (1<<7), /* IP fragment which could not be reassembled, see consumer_thread_attr.reassemble */
+  PACKET_REASSEMBLED = (1<<8), /* IP datagram reassembled from fragments */
 };
 
 struct frame_t {
@@ -45,11 +101,13 @@ struct frame_t {
   union {
     /* IP */
     struct {
-      struct ip* ip;
+      struct ip* ip;        /* NULL for IPv6 */
+      struct ip6_hdr* ip6;  /* NULL for IPv4 */
       union {
 	struct tcphdr* tcp;
 	struct udphdr* udp;
 	struct icmphdr* icmp;
+	struct icmp6_hdr* icmp6;
       };
     };
 
@@ -60,32 +118,657 @@ struct frame_t {
     } arp;
   };
   char* payload;
+
+  /* outermost layer of a tunnelled frame */
+  struct {
+    int tunnel;               /* enum frame_tunnel, FRAME_TUNNEL_NONE if not tunnelled */
+    unsigned int depth;
+    struct ip* ip;            /* NULL for IPv6 */
+    struct ip6_hdr* ip6;      /* NULL for IPv4 */
+    struct udphdr* udp;       /* VXLAN and GTP-U */
+  } outer;
 };
 
+/**
+ * Result of classifying a frame. Classification never prints anything, use
+ * classify_packet_verbose() for diagnostics.
+ */
+enum classify_result {
+  CLASSIFY_OK = 0,            /* all headers found */
+  CLASSIFY_TRUNCATED,         /* a header is cut short by caplen (or by its own length) */
+  CLASSIFY_UNKNOWN_ETHERTYPE, /* not IPv4, IPv6 or ARP */
+  CLASSIFY_UNKNOWN_PROTOCOL,  /* IP but not TCP, UDP, ICMP or ICMPv6 */
+  CLASSIFY_FRAGMENT,          /* IP fragment without the transport header */
+
+  CLASSIFY_RESULT_MAX
+};
+
+/**
+ * Ethertypes counted by struct classify_stats.
+ */
+enum classify_ethertype {
+  CLASSIFY_ETH_IP = 0,
+  CLASSIFY_ETH_IPV6,
+  CLASSIFY_ETH_ARP,
+  CLASSIFY_ETH_MP,
+  CLASSIFY_ETH_STP,
+  CLASSIFY_ETH_CDP,
+  CLASSIFY_ETH_MPLS,   /* mpls with a payload other than IP */
+  CLASSIFY_ETH_OTHER,
+
+  CLASSIFY_ETH_MAX
+};
+
+/**
+ * Classification counters, see consumer_thread_classify_stats().
+ */
+struct classify_stats {
+  uint64_t result[CLASSIFY_RESULT_MAX];   /* packets by enum classify_result */
+  uint64_t ethertype[CLASSIFY_ETH_MAX];   /* packets by ethertype (after tags and labels) */
+  uint64_t vlan;                          /* vlan tagged packets */
+  uint64_t mpls;                          /* mpls labelled packets */
+  uint64_t tunnel[FRAME_TUNNEL_MAX];      /* packets by outermost tunnel */
+  uint64_t ip_proto[256];                 /* IPv4 and IPv6 packets by protocol */
+};
+
+/**
+ * Classify a frame and fill in pointers to its headers.
+ *
+ * @return enum classify_result, 0 if the frame was fully classified.
+ */
 int classify_packet(struct cap_header* cp, struct frame_t* frame);
+
+/**
+ * Same as classify_packet() but describes vlan tags and frames which could
+ * not be fully classified on dst.
+ */
+int classify_packet_verbose(FILE* dst, struct cap_header* cp, struct frame_t* frame);
+
+/**
+ * Description of an enum classify_result.
+ */
+const char* classify_result_string(int result);
+
+/**
+ * Classify the caplen captured bytes of a frame without printing anything.
+ * Packets read through the consumer are already classified (packet.info) so
+ * this is only needed for frames from other sources.
+ *
+ * @return enum classify_result, also stored in info.
+ */
+int classify_packet_offsets(const struct cap_header* cp, struct frame_info* info);
+
+/**
+ * Same as classify_packet_offsets() but decapsulates at most depth tunnels
+ * instead of CLASSIFY_TUNNEL_DEPTH.
+ */
+int classify_packet_depth(const struct cap_header* cp, struct frame_info* info, unsigned int depth);
+
+/**
+ * Cut a copy of a packet to caplen bytes (e.g. MAX_CAPTURE_SIZE). It is
+ * classified again, decapsulating as many tunnels as before, so the offsets in
+ * packet.info stay within the copied bytes. PACKET_FRAGMENT and
+ * PACKET_REASSEMBLED are kept.
+ *
+ * This always uses the generic classifier. The copies made by the
+ * consumer_thread_poll() family are classified again the same way as when they
+ * were stored instead, i.e. with consumer_thread_attr.classify if set.
+ */
+void packet_truncate(struct packet* pkt, size_t caplen);
+
+/**
+ * A classifier of the caplen captured bytes of the frame at data (starting
+ * with the ethernet header), see classify_specialized().
+ *
+ * @return enum classify_result, also stored in info.
+ */
+typedef int (*classify_func)(const void* data, size_t caplen, struct frame_info* info);
+
+/**
+ * Classifier compiled for the protocols in types only, a mask of PACKET_IP,
+ * PACKET_IPV6, TRANSPORT_TCP and TRANSPORT_UDP (see classify.hpp). Without a
+ * network protocol both IPv4 and IPv6 are accepted, without a transport
+ * protocol any is. Vlan tags and mpls labels are stripped, tunnels are not
+ * decapsulated. For matching frames info is the same as from
+ * classify_packet_offsets(), other frames are given up on at the first layer
+ * which doesn't match.
+ *
+ * @return NULL if types has other bits set.
+ */
+classify_func classify_specialized(uint32_t types);
+
+/**
+ * Flow hash stored in packet.hash, see consumer_thread_attr.flow_hash.
+ */
+enum flow_hash_mode {
+  FLOW_HASH_CRC32C = 0,  /* symmetric CRC32C of the 5-tuple, packet_flow_hash() */
+  FLOW_HASH_TOEPLITZ,    /* RSS Toeplitz hash, packet_flow_hash_toeplitz() */
+};
+
+/* size of a Toeplitz (RSS) key */
+#define FLOW_HASH_KEY_SIZE 40
+
+/**
+ * Symmetric flow hash of a classified frame: CRC32C (using the SSE4.2
+ * instruction if the CPU has it) of the endpoints (address and port) in
+ * ascending order and the IP protocol, so both directions of a flow get the
+ * same hash. Frames which are neither IPv4 nor IPv6 are hashed on their
+ * ethernet addresses. For tunnelled frames the inner packet is hashed.
+ */
+uint32_t packet_flow_hash(const struct cap_header* cp, const struct frame_info* info);
+
+/**
+ * packet_flow_hash() of n packets, interleaved so it runs faster than one
+ * packet at a time.
+ */
+void packet_flow_hash_batch(const struct packet** pkt, size_t n, uint32_t* hash);
+
+/**
+ * Toeplitz hash of a classified frame as computed by NICs for RSS: over the
+ * source and destination address followed by the TCP or UDP ports. Frames
+ * which are neither IPv4 nor IPv6 hash to 0.
+ *
+ * @param key FLOW_HASH_KEY_SIZE bytes, e.g. the key the NIC is configured
+ *            with, or NULL for the symmetric key (0x6d5a repeated). Only with
+ *            a symmetric key do both directions get the same hash.
+ */
+uint32_t packet_flow_hash_toeplitz(const struct cap_header* cp, const struct frame_info* info, const uint8_t* key);
+
+/**
+ * Name of an enum frame_tunnel.
+ */
+const char* frame_tunnel_name(int tunnel);
+
+/**
+ * Fill in the pointers of frame from a classification of the frame at cp.
+ */
+void frame_from_info(struct cap_header* cp, const struct frame_info* info, struct frame_t* frame);
+
+/**
+ * Tag control information (host order) of a vlan tag of a classified frame.
+ *
+ * @param index 0 for the outer tag up to info->tags - 1 for the inner tag.
+ */
+uint16_t frame_vlan_tci(const struct cap_header* cp, const struct frame_info* info, unsigned int index);
+
+/**
+ * Label of an mpls label stack entry of a classified frame.
+ *
+ * @param index 0 for the outer label up to info->labels - 1 for the bottom label.
+ */
+uint32_t frame_mpls_label(const struct cap_header* cp, const struct frame_info* info, unsigned int index);
+
 void print_frame(FILE* dst, const struct frame_t* frame, int show_payload);
 
+/**
+ * Kernels of packet_tuples_extract().
+ */
+enum tuples_kernel {
+  TUPLES_AUTO = 0,   /* TUPLES_SSE4 if the CPU has it, otherwise TUPLES_SCALAR */
+  TUPLES_SCALAR,
+  TUPLES_SSE4,       /* SSE4.1 byte shuffles (x86-64) */
+  TUPLES_AVX2,       /* AVX2 gathers and byte shuffles (x86-64), never chosen
+		      * by TUPLES_AUTO as the gathers are no faster */
+};
+
+/**
+ * The fields most analysis needs of a batch of packets, as contiguous arrays
+ * (structure of arrays) so the code aggregating them can be vectorized. Entry
+ * i of each array is from the same packet. Addresses and ports are in host
+ * order. Allocated with packet_tuples_init(), filled by
+ * packet_tuples_extract() or consumer_thread_poll_tuples().
+ */
+struct packet_tuples {
+  size_t capacity;      /* entries in each array */
+  size_t n;             /* valid entries */
+  int kernel;           /* enum tuples_kernel in use, never TUPLES_AUTO */
+
+  uint32_t* type;       /* info.type */
+  uint8_t* proto;       /* info.proto, IP protocol or 0 */
+  uint32_t* src_ip;     /* IPv4 source, 0 if type doesn't have PACKET_IP */
+  uint32_t* dst_ip;     /* IPv4 destination, 0 if type doesn't have PACKET_IP */
+  uint16_t* src_port;   /* TCP or UDP source port, 0 for other packets */
+  uint16_t* dst_port;   /* TCP or UDP destination port, 0 for other packets */
+  uint32_t* len;        /* length on the wire (caphead.len) */
+  uint64_t* timestamp;  /* caphead.ts in ns */
+  uint32_t* hash;       /* packet.hash */
+
+  const struct packet** pkt; /* the packets of the last poll (borrowed) */
+};
+
+/**
+ * Allocate the arrays (cache line aligned) for capacity packets.
+ *
+ * @param kernel TUPLES_AUTO or a specific kernel, e.g. for comparisons.
+ * @return ENOTSUP if the CPU (or platform) lacks the kernel, ENOMEM.
+ */
+int packet_tuples_init(struct packet_tuples* t, size_t capacity, enum tuples_kernel kernel);
+void packet_tuples_free(struct packet_tuples* t);
+
+/**
+ * Fill the arrays from up to capacity classified packets, e.g. slots borrowed
+ * with consumer_thread_acquire_batch().
+ *
+ * @return Number of packets extracted, also stored in t->n.
+ */
+size_t packet_tuples_extract(struct packet_tuples* t, const struct packet** pkt, size_t n);
+
+/**
+ * Name of an enum tuples_kernel.
+ */
+const char* packet_tuples_kernel_name(int kernel);
+
 typedef struct consumer_thread* consumer_thread_t;
+typedef struct consumer_reader* consumer_reader_t;
+
+/**
+ * What to do with new packets when the buffer (or a merge queue) is full.
+ */
+enum consumer_overflow {
+  CONSUMER_DROP_OLDEST = 0, /* overwrite the oldest unread packets */
+  CONSUMER_DROP_NEWEST,     /* discard the new packet */
+  CONSUMER_BLOCK,           /* stop reading streams until there is room */
+  CONSUMER_SPILL,           /* write to disk until there is room, see spill_dir */
+};
+
+/**
+ * Called when packets have been dropped, at most once per notify_interval.
+ * The call is made from a thread reading streams so it should return quickly.
+ *
+ * @param dropped Packets dropped since the last notification.
+ * @param total Packets dropped in total.
+ */
+typedef void (*consumer_overflow_func)(consumer_thread_t con, uint64_t dropped, uint64_t total, void* arg);
+
+struct consumer_thread_attr {
+  size_t buffer_size;   /* buffer capacity in bytes (rounded up to a power of two, at most 2 GB), at most buffer_size / 64 packets */
+  timepico delay;       /* added to each packet timestamp */
+
+  /* Merge mode: each stream is read by its own thread into a private queue
+   * and the queues are merged into the buffer in timestamp order. A packet is
+   * held back until every stream has a packet queued or until it is older than
+   * the newest timestamp seen minus merge_lateness. Streams which have been
+   * quiet for merge_lateness (wall time) are not waited for. */
+  int merge;
+  size_t merge_buffer_size; /* per-stream queue capacity in bytes */
+  timepico merge_lateness;
+
+  /* Idle policy: after idle_spin rounds without packets the reader thread(s)
+   * block for up to idle_timeout ms waiting for a stream to become readable. */
+  unsigned int idle_spin;
+  unsigned int idle_timeout;
+
+  /* Overflow policy. If notify is NULL a message is written to stderr
+   * instead, also at most once per notify_interval ms. */
+  enum consumer_overflow overflow;
+  consumer_overflow_func notify;
+  void* notify_arg;
+  unsigned int notify_interval;
+
+  /* CONSUMER_SPILL: packets which do not fit in the buffer are written to
+   * pre-allocated segment files in spill_dir (default /var/tmp), using at most
+   * spill_segments * spill_segment_size bytes of disk. Spilled packets are
+   * moved back to the buffer in order as soon as there is room. Packets which
+   * do not fit in the spill either are dropped. In merge mode the stream
+   * queues block instead. */
+  const char* spill_dir;
+  size_t spill_segment_size;
+  size_t spill_segments;
+
+  /* Broadcast mode: the buffer has no default reader, so the
+   * consumer_thread_poll() family must not be used. Instead each consumer
+   * opens its own reader with consumer_reader_open(). Either way the slowest
+   * reader decides when the buffer is full. */
+  int broadcast;
+
+  /* Sharding: packets are routed to one of shards queues by their flow hash
+   * (packet.hash), so with a symmetric hash both directions of a flow end up
+   * in the same queue.
+   * Each queue is read through its own endpoint, see consumer_thread_shard(),
+   * and gets buffer_size / shards bytes. The default reader gets nothing.
+   * Cannot be combined with CONSUMER_SPILL. */
+  unsigned int shards;
+
+  /* Shared mode: the default reader may be used by several threads at once,
+   * each getting its own packets (lock-free, in batches with
+   * consumer_thread_poll_batch()). Borrowed packets are handed back with
+   * consumer_thread_release() or consumer_thread_release_packets(), in any
+   * order. The buffer is never overwritten, CONSUMER_DROP_OLDEST discards the
+   * new packets instead. */
+  int shared;
+
+  /* Fair mode: each stream is queued separately (fair_buffer_size bytes by
+   * default, see consumer_thread_add_stream_attr()) and the consumer_thread_poll()
+   * family takes packets from the queues by deficit round-robin: each round a
+   * stream may send fair_quantum bytes times its weight. A flood on one stream
+   * thus only fills (and overflows) its own queue. Packets from different
+   * streams are not kept in order. With CONSUMER_BLOCK a full queue stops the
+   * reading of all streams. Cannot be combined with merge, broadcast, shards,
+   * shared or CONSUMER_SPILL. */
+  int fair;
+  size_t fair_buffer_size;
+  size_t fair_quantum;
+
+  /* Memory of the buffer and queues: hugepages backs them with 2 MB pages
+   * (transparent hugepages if none are reserved), numa_node binds them to a
+   * node (-1 for any) and lazy leaves the pages to be faulted in on first use
+   * (MAP_NORESERVE). With hugepages or numa_node set and lazy unset, every
+   * page is faulted in by consumer_thread_init_attr(). */
+  int hugepages;
+  int lazy;
+  int numa_node;
+
+  /* CPU to pin the consumer thread (the merge thread in merge mode) to, -1 for
+   * any. The polling thread is pinned with consumer_pin_thread(). */
+  int reader_cpu;
+
+  /* Tunnels (GRE, VXLAN, GTP-U, IP-in-IP) decapsulated when packets are
+   * classified, see struct frame_info. 0 classifies the outer headers only. */
+  unsigned int tunnel_depth;
+
+  /* Classifier used instead of the default one, e.g. from
+   * classify_specialized() when only some protocols are of interest. NULL for
+   * the default (which honours tunnel_depth). */
+  classify_func classify;
+
+  /* Flow hash computed for each packet when it is read (packet.hash) and
+   * used to pick the shard. With FLOW_HASH_TOEPLITZ the hash is the same as
+   * the RSS hash of a NIC using rss_key (FLOW_HASH_KEY_SIZE bytes, NULL for
+   * the symmetric key, only read by consumer_thread_init_attr()). */
+  enum flow_hash_mode flow_hash;
+  const uint8_t* rss_key;
+
+  /* Fragment reassembly: IPv4 and IPv6 fragments are held until the whole
+   * datagram has been read, which is then stored (classified, with
+   * PACKET_REASSEMBLED) in place of the fragments, with the timestamp of the
+   * last fragment. Fragments are held in reassembly_memory bytes of buffers
+   * allocated up front; when they run out the oldest datagram is given up.
+   * Datagrams still incomplete reassembly_timeout ms (packet time) after their
+   * first fragment are given up too. The fragments of a datagram given up are
+   * stored as they are (late, so out of timestamp order) with PACKET_FRAGMENT,
+   * as are fragments which cannot be reassembled at all: truncated (see
+   * consumer_thread_set_snaplen()), longer than MAX_CAPTURE_SIZE, overlapping
+   * or inconsistent. Only the outer IP layer of a tunnel is reassembled. See
+   * consumer_thread_reassembly_stats(). */
+  int reassemble;
+  size_t reassembly_memory;
+  unsigned int reassembly_timeout;
+};
+
+/**
+ * Per-stream settings, see consumer_thread_add_stream_attr().
+ */
+struct consumer_stream_attr {
+  size_t buffer_size;   /* merge or fair queue capacity in bytes, 0 for the default */
+  unsigned int weight;  /* fair mode: share of the rounds, 0 is treated as 1 */
+};
+
+struct consumer_thread_stats {
+  uint64_t idle_time;   /* ns the reader thread(s) have spent waiting for packets */
+  uint64_t busy_time;   /* ns the reader thread(s) have spent working */
+  uint64_t packets;     /* packets stored in the buffer */
+  uint64_t pending;     /* unread packets, including spilled packets and shards */
+  uint64_t late;        /* packets which missed the merge watermark */
+  uint64_t streams;     /* streams currently read */
+  uint64_t dropped;     /* packets dropped because of overflow */
+  uint64_t dropped_bytes;
+  uint64_t spilled;     /* packets written to the spill */
+  uint64_t recovered;   /* spilled packets moved back to the buffer */
+};
+
+struct consumer_reassembly_stats {
+  uint64_t fragments;   /* fragments read */
+  uint64_t reassembled; /* datagrams stored */
+  uint64_t timeouts;    /* datagrams given up after reassembly_timeout */
+  uint64_t evicted;     /* datagrams given up for lack of memory */
+  uint64_t rejected;    /* fragments which could not be reassembled */
+  uint64_t pending;     /* incomplete datagrams */
+  uint64_t memory;      /* bytes of fragment buffers in use */
+  uint64_t memory_peak;
+  uint64_t memory_limit;
+};
+
+struct consumer_reader_stats {
+  uint64_t read;        /* packets read */
+  uint64_t dropped;     /* packets overwritten before this reader got to them */
+  uint64_t lag;         /* unread packets */
+  uint64_t lag_bytes;
+};
+
+struct consumer_stream_stats {
+  uint64_t dropped;     /* packets from the stream dropped because of overflow */
+  uint64_t dropped_bytes;
+  uint64_t queued;      /* merge or fair mode: packets in the stream queue */
+  uint64_t queued_bytes;
+  uint64_t capacity;    /* merge or fair mode: queue capacity in bytes */
+  unsigned int weight;
+};
+
+  /**
+   * Initialize attributes with default values.
+   */
+  void consumer_thread_attr_init(struct consumer_thread_attr* attr);
+
+  /**
+   * Create a consumer thread.
+   *
+   * @param buffer_size Buffer capacity, in number of MAX_CAPTURE_SIZE packets.
+   * @param delay Optional delay, may be NULL.
+   */
   int consumer_thread_init(consumer_thread_t* con, size_t buffer_size, const timepico* delay);
+  int consumer_thread_init_attr(consumer_thread_t* con, const struct consumer_thread_attr* attr);
+
+  /**
+   * Open a stream and start reading from it. Streams may be added at any
+   * time, also while the consumer is running. The n:th added stream gets
+   * stream_id n-1; ids are never reused.
+   */
 long consumer_thread_add_stream(consumer_thread_t con, const stream_addr_t* src, const char* nic, int port, struct filter* filter);
+
+  /**
+   * Same as consumer_thread_add_stream() but with per-stream settings, attr
+   * may be NULL for the defaults.
+   */
+  long consumer_thread_add_stream_attr(consumer_thread_t con, const stream_addr_t* src, const char* nic, int port, struct filter* filter, const struct consumer_stream_attr* attr);
+
+  /**
+   * Stop reading from a stream and close it. Packets already read from the
+   * stream are still delivered (in merge and fair mode the stream queue is
+   * drained before the call returns). With CONSUMER_BLOCK, and in fair mode,
+   * this requires the buffer to be read by another thread.
+   *
+   * @return ENOENT if there is no such stream, ENOMEM if the new stream table
+   *         could not be allocated.
+   */
+  int consumer_thread_remove_stream(consumer_thread_t con, int stream_id);
+
+  /**
+   * Change the idle policy, see struct consumer_thread_attr.
+   */
+  int consumer_thread_set_idle(consumer_thread_t con, unsigned int spin, unsigned int timeout);
+
+  /**
+   * Get statistics. Times are summed over all reader threads.
+   */
+  void consumer_thread_stats(consumer_thread_t con, struct consumer_thread_stats* stats);
+
+  /**
+   * Get fragment reassembly statistics.
+   *
+   * @return EINVAL if reassembly isn't enabled.
+   */
+  int consumer_thread_reassembly_stats(consumer_thread_t con, struct consumer_reassembly_stats* stats);
+
+  /**
+   * Get statistics for a single stream.
+   *
+   * @return ENOENT if there is no such stream.
+   */
+  int consumer_thread_stream_stats(consumer_thread_t con, int stream_id, struct consumer_stream_stats* stats);
+
+  /**
+   * Get classification counters for a single stream, or summed over all
+   * streams (including removed streams) if stream_id is -1.
+   *
+   * @return ENOENT if there is no such stream.
+   */
+  int consumer_thread_classify_stats(consumer_thread_t con, int stream_id, struct classify_stats* stats);
+
+  /**
+   * Truncate packets from a stream to snaplen bytes when they are stored in
+   * the buffer.
+   *
+   * @param stream_id Stream index, in the order the streams were added.
+   * @param snaplen Max number of bytes, 0 to disable.
+   * @return ENOENT if there is no such stream.
+   */
+  int consumer_thread_set_snaplen(consumer_thread_t con, int stream_id, size_t snaplen);
+
+  /**
+   * Change the weight of a stream in fair mode.
+   *
+   * @return ENOENT if there is no such stream, EINVAL if weight is 0.
+   */
+  int consumer_thread_set_weight(consumer_thread_t con, int stream_id, unsigned int weight);
 int consumer_thread_destroy(consumer_thread_t con);
 
   /**
    * Read a packet from the buffer.
    *
    * @param pkt Packet will be copied here.
-   * @param timeout timeout in ms.
+   * @param timeout timeout in ms. With a delay the call sleeps until the
+   *                oldest packet is due, if that is within the timeout.
    * @return 1 if a packet was read or 0 if no packet is available yet.
    */
   int consumer_thread_poll(consumer_thread_t con, struct packet* pkt, unsigned int timeout);
 
+  /**
+   * Borrow the oldest packet directly from the buffer, without copying it.
+   * The slot stays valid (and is never overwritten by the reader thread) until
+   * it is handed back with consumer_thread_release(). Only one packet may be
+   * borrowed at a time.
+   *
+   * @param timeout timeout in ms.
+   * @return Pointer to the packet or NULL if no packet is available yet.
+   */
+  const struct packet* consumer_thread_acquire(consumer_thread_t con, unsigned int timeout);
+
+  /**
+   * Return a packet borrowed by consumer_thread_acquire() to the buffer.
+   */
+  void consumer_thread_release(consumer_thread_t con, const struct packet* pkt);
+
+  /**
+   * Read up to n packets from the buffer using a single clock reading and
+   * synchronization step.
+   *
+   * @param pkt Array of at least n packets, packets will be copied here.
+   * @param timeout timeout in ms (only used while the buffer is empty or the
+   *                oldest packet is not due yet).
+   * @param remaining If non-NULL it is set to the number of packets still left
+   *                  in the buffer (including those not due yet).
+   * @return Number of packets read.
+   */
+  size_t consumer_thread_poll_batch(consumer_thread_t con, struct packet* pkt, size_t n, unsigned int timeout, size_t* remaining);
+
+  /**
+   * Borrow up to n packets from the buffer, see consumer_thread_acquire() and
+   * consumer_thread_poll_batch(). The whole batch must be handed back with
+   * consumer_thread_release_batch() before acquiring again (except in shared
+   * mode, see consumer_thread_release_packets()).
+   *
+   * @return Number of packets borrowed.
+   */
+  size_t consumer_thread_acquire_batch(consumer_thread_t con, const struct packet** pkt, size_t n, unsigned int timeout, size_t* remaining);
+
+  /**
+   * Return the n packets borrowed by consumer_thread_acquire_batch(). Not
+   * available in shared mode, use consumer_thread_release_packets() instead.
+   */
+  void consumer_thread_release_batch(consumer_thread_t con, size_t n);
+
+  /**
+   * Return packets borrowed by consumer_thread_acquire_batch() (the whole
+   * batch, in the same order, unless in shared mode where any packets may be
+   * returned in any order).
+   */
+  void consumer_thread_release_packets(consumer_thread_t con, const struct packet** pkt, size_t n);
+
+  /**
+   * Read up to t->capacity packets from the buffer directly into the arrays of
+   * t, see consumer_thread_poll_batch(). The packets themselves are handed
+   * back before returning.
+   *
+   * @return Number of packets read, also stored in t->n.
+   */
+  size_t consumer_thread_poll_tuples(consumer_thread_t con, struct packet_tuples* t, unsigned int timeout, size_t* remaining);
+
   /**
    * Returns the number of unread packets in the buffer.
    */
   int consumer_thread_pending(consumer_thread_t con);
 
-  void consumer_lock(consumer_thread_t con);
-  void consumer_unlock(consumer_thread_t con);
+  /**
+   * Open an additional reader. Every reader sees all packets stored while it
+   * is open, independently of the other readers, so several consumers (each
+   * using its own reader from one thread) can share the same streams. At most
+   * 16 readers (including the default one) can be open at once.
+   *
+   * @param oldest If non-zero the reader starts at the oldest packet not yet
+   *               read by all readers, otherwise at the next new packet.
+   * @return EBUSY if there are too many readers, EINVAL in fair mode.
+   */
+  int consumer_reader_open(consumer_thread_t con, consumer_reader_t* reader, int oldest);
+  void consumer_reader_close(consumer_reader_t reader);
+  void consumer_reader_stats(consumer_reader_t reader, struct consumer_reader_stats* stats);
+
+  /**
+   * Same as the consumer_thread_poll() family but for a reader opened with
+   * consumer_reader_open().
+   */
+  int consumer_reader_poll(consumer_reader_t reader, struct packet* pkt, unsigned int timeout);
+  size_t consumer_reader_poll_batch(consumer_reader_t reader, struct packet* pkt, size_t n, unsigned int timeout, size_t* remaining);
+  const struct packet* consumer_reader_acquire(consumer_reader_t reader, unsigned int timeout);
+  void consumer_reader_release(consumer_reader_t reader, const struct packet* pkt);
+  size_t consumer_reader_acquire_batch(consumer_reader_t reader, const struct packet** pkt, size_t n, unsigned int timeout, size_t* remaining);
+  void consumer_reader_release_batch(consumer_reader_t reader, size_t n);
+  void consumer_reader_release_packets(consumer_reader_t reader, const struct packet** pkt, size_t n);
+  size_t consumer_reader_poll_tuples(consumer_reader_t reader, struct packet_tuples* t, unsigned int timeout, size_t* remaining);
+
+  /**
+   * Poll endpoint of a shard, to be used with the consumer_reader_poll()
+   * family by a single worker. Returns NULL if there is no such shard.
+   */
+  consumer_reader_t consumer_thread_shard(consumer_thread_t con, unsigned int shard);
+
+  /**
+   * Number of unread packets in a shard queue.
+   */
+  size_t consumer_thread_shard_depth(consumer_thread_t con, unsigned int shard);
+
+  /**
+   * Pin the calling thread, e.g. the one polling the buffer, to a CPU.
+   * Preferably one on the node given by numa_node.
+   */
+  int consumer_pin_thread(int cpu);
+
+  /**
+   * Deprecated, these do nothing. The buffer is lock-free and the producer
+   * never took this lock, so it never protected consumer_buffer_get().
+   */
+  void consumer_lock(consumer_thread_t con) __attribute__((deprecated));
+  void consumer_unlock(consumer_thread_t con) __attribute__((deprecated));
+
+  /**
+   * Get the index:th packet unread by the default reader (without consuming
+   * it), or NULL if there is no such packet. Must only be called by the thread
+   * polling the buffer. Always NULL in fair and broadcast mode (there is no
+   * default reader).
+   *
+   * Not safe while packets are ingested with CONSUMER_DROP_OLDEST: the
+   * producer may overwrite the record while it is being read. With the other
+   * policies unread records are never reused.
+   */
   struct packet* consumer_buffer_get(consumer_thread_t con, unsigned int index);
 
 #ifdef __cplusplus
@@ -0,0 +1,40 @@
+#ifndef CONSUMER_FLOWHASH_H
+#define CONSUMER_FLOWHASH_H
+
+#include "consumer.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* longest RSS input: IPv6 addresses and ports */
+#define TOEPLITZ_INPUT_MAX 36
+
+/**
+ * Toeplitz hash of each byte value at each input position for a given key,
+ * so hashing takes one lookup per input byte instead of one step per bit.
+ */
+struct toeplitz {
+  uint32_t table[TOEPLITZ_INPUT_MAX][256];
+};
+
+/**
+ * @param key FLOW_HASH_KEY_SIZE bytes, NULL for the symmetric key.
+ */
+void toeplitz_init(struct toeplitz* t, const uint8_t* key);
+
+/**
+ * Symmetric CRC32C flow hash of the first caplen bytes of a classified frame.
+ */
+uint32_t flow_hash_crc32c(const char* data, size_t caplen, const struct frame_info* info);
+
+/**
+ * Toeplitz (RSS) flow hash of the first caplen bytes of a classified frame.
+ */
+uint32_t flow_hash_toeplitz(const struct toeplitz* t, const char* data, size_t caplen, const struct frame_info* info);
+
+/**
+ * Name of the CRC32C implementation in use ("sse4.2" or "software").
+ */
+const char* flow_hash_crc32c_impl(void);
+
+#endif /* CONSUMER_FLOWHASH_H */
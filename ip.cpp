@@ -20,7 +20,9 @@
 #include <vector>
 #include "gtk_pie_chart.h"
 
-#define BUFFER_SIZE 150000 /* nr of packages, not bytes */
+#define BUFFER_SIZE (32*1024*1024) /* bytes */
+#define MAX_PACKETS 300000 /* nr of packages drawn per frame */
+#define BATCH_SIZE 1024   /* nr of packages borrowed from the buffer at once */
 
 static GdkGLConfig* glconfig = NULL;
 static GtkWidget* window = NULL;
@@ -322,9 +324,7 @@ extern "C" {
     glUseProgram(0);
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    struct cap_header head;
-    struct frame_t frame;
-    int stream_id;
+    const struct packet* pkt[BATCH_SIZE];
     //char src[100];
     //char dst[100];
 
@@ -332,53 +332,68 @@ extern "C" {
     glBlendFunc(GL_ONE, GL_ONE);
 
     int n = 0;
-    while ( consumer_thread_poll(con, &head, &frame, &stream_id) ){
-      if ( n++ > BUFFER_SIZE*2 ){ /* packets max */
-	printf("breaking\n");
-	break;
-      }
-      
-      GdkColor* color;
-
-      if ( (frame.type&PACKET_IP) && (frame.type&TRANSPORT_TCP) ){
-	stat_transport.tcp++;
-	color = &tcp_color;
-      } else if ( (frame.type&PACKET_IP) && (frame.type&TRANSPORT_UDP) ){
-	stat_transport.udp++;
-	color = &udp_color;
-      } else if ( frame.type & PACKET_ICMP ){
-	stat_transport.icmp++;
-	color = &icmp_color;
-      } else if ( frame.type & PACKET_ARP ){
-	stat_transport.arp++;
-	continue;
-      } else {
-	stat_transport.other++;
-	continue;
+    size_t count;
+    while ( (count=consumer_thread_acquire_batch(con, pkt, BATCH_SIZE, 0, NULL)) > 0 ){
+      for ( size_t i = 0; i < count; i++ ){
+	/* the packets are classified when read, the slots are held until the batch is drawn */
+	const struct frame_info& frame = pkt[i]->info;
+	const int stream_id = pkt[i]->stream_id;
+	GdkColor* color;
+
+	if ( frame.type & TRANSPORT_TCP ){
+	  stat_transport.tcp++;
+	  color = &tcp_color;
+	} else if ( frame.type & TRANSPORT_UDP ){
+	  stat_transport.udp++;
+	  color = &udp_color;
+	} else if ( frame.type & PACKET_ICMP ){
+	  stat_transport.icmp++;
+	  color = &icmp_color;
+	} else if ( frame.type & PACKET_ARP ){
+	  stat_transport.arp++;
+	  continue;
+	} else {
+	  stat_transport.other++;
+	  continue;
+	}
+
+	/* IPv6 is counted but only IPv4 addresses are plotted */
+	if ( !(frame.type & PACKET_IP) ){
+	  continue;
+	}
+
+	glColor4f((float)color->red/0xffff, (float)color->green/0xffff, (float)color->blue/0xffff, 1.0f);
+
+	//strcpy(src, inet_ntoa(frame.ip->ip_src));
+	//strcpy(dst, inet_ntoa(frame.ip->ip_dst));
+
+	union {
+	  uint32_t i;
+	  unsigned char c[4];
+	} src, dst;
+
+	const struct ip* ip = reinterpret_cast<const struct ip*>(pkt[i]->buf + frame.l3_offset);
+	src.i = ntohl(ip->ip_src.s_addr);
+	dst.i = ntohl(ip->ip_dst.s_addr);
+	float y = 1.0;
+	if ( stream_id == 1 ){
+	  y = 0.0;
+	}
+
+	glBegin(GL_TRIANGLES);
+	glVertex2f(((float)src.c[3]) / 255 - 0.006, y);
+	glVertex2f(((float)dst.c[3]) / 255, 1.0 - y);
+	glVertex2f(((float)src.c[3]) / 255 + 0.006, y);
+	glEnd();
       }
 
-      glColor4f((float)color->red/0xffff, (float)color->green/0xffff, (float)color->blue/0xffff, 1.0f);
-      
-      //strcpy(src, inet_ntoa(frame.ip->ip_src));
-      //strcpy(dst, inet_ntoa(frame.ip->ip_dst));
+      consumer_thread_release_batch(con, count);
 
-      union {
-	uint32_t i;
-	unsigned char c[4];
-      } src, dst;
-      
-      src.i = ntohl(frame.ip->ip_src.s_addr);
-      dst.i = ntohl(frame.ip->ip_dst.s_addr);
-      float y = 1.0;
-      if ( stream_id == 1 ){
-	y = 0.0;
+      n += count;
+      if ( n > MAX_PACKETS ){
+	printf("breaking\n");
+	break;
       }
-
-      glBegin(GL_TRIANGLES);
-      glVertex2f(((float)src.c[3]) / 255 - 0.006, y);
-      glVertex2f(((float)dst.c[3]) / 255, 1.0 - y);
-      glVertex2f(((float)src.c[3]) / 255 + 0.006, y);
-      glEnd();
     }
 
     glPopAttrib();
@@ -530,11 +545,17 @@ int main(int argc, char **argv){
   filter_from_argv(&argc, argv, &filter);
 
   long ret;
-  timepico delay = {2, 0};
-  consumer_thread_init(&con, BUFFER_SIZE, &delay);
+  struct consumer_thread_attr attr;
+  consumer_thread_attr_init(&attr);
+  attr.buffer_size = BUFFER_SIZE;
+  attr.delay.tv_sec = 2;
+  consumer_thread_init_attr(&con, &attr);
   (ret=consumer_thread_add_stream(con, "01:00:00:00:00:01", 1, "br0", 0, &filter)) == 0 || printf("strean 1 failed: %s\n", caputils_error_string(ret));
   (ret=consumer_thread_add_stream(con, "01:00:00:00:00:02", 1, "br0", 0, &filter)) == 0 || printf("stream 2 failed: %s\n", caputils_error_string(ret));
   (ret=consumer_thread_add_stream(con, "01:00:00:00:00:03", 1, "br0", 0, &filter)) == 0 || printf("stream 3 failed: %s\n", caputils_error_string(ret));
+  for ( int i = 0; i < 3; i++ ){
+    consumer_thread_set_snaplen(con, i, 96); /* only the headers are drawn */
+  }
 
   gtk_widget_show_all(window);
   gtk_main();
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <sys/time.h>
 #include <getopt.h>
 #include <errno.h>
 
@@ -26,9 +27,13 @@
 struct {
   int print_content;
   int cDate;
+  int rss;
   unsigned long long max_pkts;
 } args;
 
+/* block in stream_read() instead of spinning when there is no data */
+#define READ_TIMEOUT 1
+
 int clone_stream(struct stream* dst, struct stream* src, const struct filter* filter, unsigned long long* matches){
   cap_head* cp;
   size_t len = sizeof(struct cap_header);
@@ -36,7 +41,8 @@ int clone_stream(struct stream* dst, struct stream* src, const struct filter* fi
 
   *matches = 0;
   while ( 1 ){
-    ret = stream_read(src, &cp, filter, NULL);
+    struct timeval tv = {READ_TIMEOUT, 0};
+    ret = stream_read(src, &cp, filter, &tv);
     if ( ret == EAGAIN ){
       continue;
     } else if ( ret != 0 ){
@@ -138,13 +144,40 @@ static void print_ieee8023(FILE* dst, const struct llc_pdu_sn* llc){
 
 }
 
-static void print_eth(FILE* dst, const struct ethhdr* eth){
-  void* payload = ((char*)eth) + sizeof(struct ethhdr);
-  uint16_t h_proto = ntohs(eth->h_proto);
-  uint16_t vlan_tci;
+static void print_eth(FILE* dst, struct cap_header* cp){
+  const struct ethhdr* eth = cp->ethhdr;
+
+  /* vlan tags and mpls labels are stripped by libcon, each is 4 bytes */
+  struct frame_info info;
+  const int ret = classify_packet_offsets(cp, &info);
+  const uint32_t hash = args.rss ? packet_flow_hash_toeplitz(cp, &info, NULL) : packet_flow_hash(cp, &info);
+  fprintf(dst, "HASH(%08x):", hash);
 
+  const char* payload = cp->payload + sizeof(struct ethhdr) + 4 * (info.tags + info.labels);
+  uint16_t h_proto = info.ethertype;
 
- begin:
+  for ( unsigned int i = 0; i < info.tags; i++ ){
+    fprintf(dst, "802.1Q vlan# %d: ", 0x0FFF & frame_vlan_tci(cp, &info, i));
+  }
+  for ( unsigned int i = 0; i < info.labels; i++ ){
+    fprintf(dst, "MPLS label# %u: ", frame_mpls_label(cp, &info, i));
+  }
+
+  /* tunnels are decapsulated by libcon, print outer endpoints and inner flow */
+  if ( info.type & PACKET_TUNNEL ){
+    struct frame_t frame;
+    frame_from_info(cp, &info, &frame);
+    print_frame(dst, &frame, 0);
+    if ( ret != CLASSIFY_OK ){
+      fprintf(dst, "(inner packet: %s)\n", classify_result_string(ret));
+    }
+    return;
+  }
+
+  if ( ret == CLASSIFY_TRUNCATED && !(info.type & (PACKET_IP | PACKET_IPV6 | PACKET_ARP)) ){
+    fprintf(dst, "Truncated frame\n");
+    return;
+  }
 
   if(h_proto<0x05DC){
     fprintf(dst, "IEEE802.3 ");
@@ -154,19 +187,21 @@ static void print_eth(FILE* dst, const struct ethhdr* eth){
     print_ieee8023(dst,(struct llc_pdu_sn*)payload);
   } else {
     switch ( h_proto ){
-    case ETHERTYPE_VLAN:
-      vlan_tci = ((uint16_t*)payload)[0];
-      h_proto = ntohs(((uint16_t*)payload)[0]);
-      payload = ((char*)eth) + sizeof(struct ethhdr);
-      fprintf(dst, "802.1Q vlan# %d: ", 0x0FFF&ntohs(vlan_tci));
-      goto begin;
-      
     case ETHERTYPE_IP:
       print_ipv4(dst, (struct ip*)payload);
       break;
       
     case ETHERTYPE_IPV6:
-      printf("ipv6\n");
+      {
+	/* extension headers are walked by libcon */
+	struct frame_t frame;
+	frame_from_info(cp, &info, &frame);
+	if ( frame.type & PACKET_IPV6 ){
+	  print_frame(dst, &frame, 0);
+	} else {
+	  fprintf(dst, "IPv6 (%s)\n", classify_result_string(ret));
+	}
+      }
       break;
       
     case ETHERTYPE_ARP:
@@ -204,7 +239,8 @@ int display_stream(struct stream* src, const struct filter* filter, unsigned lon
 
   *matches = 0;
   while ( 1 ) {
-    ret = stream_read(src, &cp, filter, NULL);
+    struct timeval tv = {READ_TIMEOUT, 0};
+    ret = stream_read(src, &cp, filter, &tv);
     if ( ret == EAGAIN ){
       continue;
     } else if ( ret != 0 ){
@@ -231,7 +267,7 @@ int display_stream(struct stream* src, const struct filter* filter, unsigned lon
 
     fprintf(stdout, "%012"PRId64":LINK(%4d):CAPLEN(%4d):", cp->ts.tv_psec, cp->len, cp->caplen);
 
-    print_eth(stdout, (struct ethhdr*)cp->payload);
+    print_eth(stdout, cp);
 
     if ( args.max_pkts > 0 && *matches + 1 > args.max_pkts) {
       /* Read enough pkts lets break. */
@@ -263,6 +299,7 @@ int main(int argc, char **argv){
     {"udp", 1,0,'u'},
     {"port", 1,0, 'v'},
     {"calender",0,0,'d'},
+    {"rss",0,0,'r'},
     {0, 0, 0, 0}
   };
   
@@ -270,6 +307,7 @@ int main(int argc, char **argv){
   args.print_content = 0;
   args.cDate = 0; /* Way to display date, cDate=0 => seconds since 1970. cDate=1 => calender date */  
   args.max_pkts = 0; /* 0: all */
+  args.rss = 0; /* 0: crc32c flow hash, 1: toeplitz */
 
   char* outFilename=0;
   int capOutfile=0;
@@ -292,7 +330,7 @@ int main(int argc, char **argv){
   while (1) {
     option_index = 0;
     
-    int op = getopt_long  (argc, argv, "hp:o:cdi:tuv:",
+    int op = getopt_long  (argc, argv, "hp:o:cdri:tuv:",
 		       long_options, &option_index);
     if (op == -1)
       break;
@@ -305,6 +343,9 @@ int main(int argc, char **argv){
 	fprintf(stderr, "Calender date\n");
 	args.cDate=1;
 	break;
+      case 'r':
+	args.rss=1;
+	break;
       case 'p':
 	fprintf(stderr, "No packets. Argument %s\n", optarg);
 	args.max_pkts=atoi(optarg);
@@ -343,6 +384,8 @@ int main(int argc, char **argv){
 	fprintf(stderr, "-p or --pkts   <NO>     Number of pkts to show [default all]\n");
 	fprintf(stderr, "-o or --output <name>   Store results to a CAP file. \n");
 	fprintf(stderr, "-d or --calender        Display date/time in YYYY-MM-DD HH:MM:SS.xx.\n");
+	fprintf(stderr, "-r or --rss             Display the Toeplitz (RSS) hash instead of the\n");
+	fprintf(stderr, "                        CRC32C flow hash, both symmetric.\n");
 	fprintf(stderr, "-i or --if <NIC>        Listen to NIC for Ethernet multicast address,\n");
 	fprintf(stderr, "                        identified by <INPUT> (01:00:00:00:00:01).\n");
 	fprintf(stderr, "-t or --tcp             Listen to a TCP stream.\n");
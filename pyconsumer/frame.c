@@ -37,16 +37,17 @@ void frame_wrapper_init(frame_wrapper* fw, struct cap_header* head, struct frame
   fw->iphdr = NULL;
   if ( frame->type & PACKET_IP ){
     fw->iphdr = iphdr_FromStruct(frame->ip);
+  }
 
-    fw->tcphdr = NULL;
-    if ( frame->type & TRANSPORT_TCP ){
-      fw->tcphdr = tcphdr_FromStruct(frame->tcp);
-    }
+  /* IPv4 or IPv6 */
+  fw->tcphdr = NULL;
+  if ( frame->type & TRANSPORT_TCP ){
+    fw->tcphdr = tcphdr_FromStruct(frame->tcp);
+  }
 
-    fw->udphdr = NULL;
-    if ( frame->type & TRANSPORT_UDP ){
-      fw->udphdr = udphdr_FromStruct(frame->udp);
-    }
+  fw->udphdr = NULL;
+  if ( frame->type & TRANSPORT_UDP ){
+    fw->udphdr = udphdr_FromStruct(frame->udp);
   }
 
 }
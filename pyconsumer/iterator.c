@@ -7,42 +7,56 @@
 
 #include <Python.h>
 #include "structmember.h"
-#include <pthread.h>
+#include <string.h>
 
 buffer_iterator* iterator_new(Consumer* consumer){
+  /* the iterator has a reader of its own so it neither consumes packets from
+   * poll() nor races with it */
+  consumer_reader_t reader;
+  int ret;
+  if ( (ret=consumer_reader_open(consumer->thread, &reader, 1)) != 0 ){
+    PyErr_SetString(PyExc_RuntimeError, strerror(ret));
+    return NULL;
+  }
+
   buffer_iterator* it = PyObject_New(buffer_iterator, &iterator_type);
+  if ( !it ){
+    consumer_reader_close(reader);
+    return NULL;
+  }
 
   Py_INCREF(consumer);
   it->consumer = consumer;
-  it->index = 0;
+  it->reader = reader;
 
   return it;
 }
 
 static void iterator_dealloc(buffer_iterator* self){
+  if ( self->reader ){
+    consumer_reader_close(self->reader);
+  }
   Py_DECREF(self->consumer);
   iterator_type.tp_free(self);
 }
 
 static PyObject* iterator_next(buffer_iterator* self){
-  packet_wrapper* pw = NULL;
-  consumer_thread_t con = self->consumer->thread;
-
-  consumer_lock(con);
-  {
-    struct packet* pkt = consumer_buffer_get(con, self->index++);
-
-    /* no more packages in buffer */
-    if ( !pkt->caphead.caplen ){
-      consumer_unlock(con);
-      PyErr_SetNone(PyExc_StopIteration);
-      return NULL;
-    }
+  const struct packet* pkt = self->reader ? consumer_reader_acquire(self->reader, 0) : NULL;
 
-    /* memory will be copied */
-     pw = packet_wrapper_new(pkt);
+  /* no more packages in buffer, let go of the reader right away so it
+   * doesn't hold back the buffer until the iterator is collected */
+  if ( !pkt ){
+    if ( self->reader ){
+      consumer_reader_close(self->reader);
+      self->reader = NULL;
+    }
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
   }
-  consumer_unlock(con);
+
+  /* memory will be copied */
+  packet_wrapper* pw = packet_wrapper_new(pkt);
+  consumer_reader_release(self->reader, pkt);
 
   return (PyObject*)pw;
 }
@@ -54,5 +68,6 @@ PyTypeObject iterator_type = {
     .tp_basicsize = sizeof(buffer_iterator),
     .tp_dealloc = (destructor)iterator_dealloc,
     .tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_ITER,
+    .tp_doc = "buffer iterator, holds back the buffer like a reader until exhausted",
     .tp_iternext = (iternextfunc)iterator_next
 };
@@ -4,10 +4,16 @@
 #include <Python.h>
 #include "pyconsumer/consumer.h"
 
+/**
+ * Iterates over the packets in the buffer using a reader of its own (see
+ * consumer_reader_open(), so not in fair mode). While the reader is open it
+ * holds back the buffer like any other reader, so it is closed as soon as the
+ * iterator is exhausted.
+ */
 typedef struct {
   PyObject_HEAD
   Consumer* consumer;
-  unsigned int index;
+  consumer_reader_t reader; /* NULL once exhausted */
 } buffer_iterator;
 
 PyTypeObject iterator_type;
@@ -9,68 +9,70 @@
 #include "pyconsumer/icmphdr.h"
 #include "structmember.h"
 #include "datetime.h"
-
-static void init_ipv4(packet_wrapper* pw, const struct ip* ip){
-  void* payload = ((char*)ip) + 4*ip->ip_hl;
-  void* data = NULL;
-
-  pw->ipv4 = (PyObject*)iphdr_FromStruct(ip);
-
-  switch( ip->ip_p ) {
-  case IPPROTO_TCP:
-    pw->tcphdr = (PyObject*)tcphdr_FromStruct((const struct tcphdr*)payload);
-    data = payload + ((const struct tcphdr*)payload)->doff * 4;
-    break;
-    
-  case IPPROTO_UDP:
-    pw->udphdr = (PyObject*)udphdr_FromStruct((const struct udphdr*)payload);
-    break;
-
-  case IPPROTO_ICMP:
-    pw->icmphdr = (PyObject*)icmphdr_FromStruct((const struct icmphdr*)payload);
-    break;
-  }
-
-  if ( data ){
-    pw->data = PyBuffer_FromMemory(data, pw->pkt.caphead.caplen - (data - (void*)pw->pkt.buf));
+#include <sys/param.h> /* MIN */
+#include <netinet/ip6.h>
+
+/* the packet was classified when it was read, see struct frame_info */
+static void init_transport(packet_wrapper* pw, const struct frame_info* info){
+  const char* frame = pw->pkt.buf;
+
+  if ( info->type & TRANSPORT_TCP ){
+    pw->tcphdr = (PyObject*)tcphdr_FromStruct((const struct tcphdr*)(frame + info->l4_offset));
+    pw->data = PyBuffer_FromMemory((void*)(frame + info->payload_offset), pw->pkt.caphead.caplen - info->payload_offset);
+  } else if ( info->type & TRANSPORT_UDP ){
+    pw->udphdr = (PyObject*)udphdr_FromStruct((const struct udphdr*)(frame + info->l4_offset));
+  } else if ( info->type & PACKET_ICMP ){
+    /* type, code and checksum are at the same place in ICMPv6 */
+    pw->icmphdr = (PyObject*)icmphdr_FromStruct((const struct icmphdr*)(frame + info->l4_offset));
   }
 }
 
-static void init_eth(packet_wrapper* pw, const struct ethhdr* eth){
-  void* payload = ((char*)eth) + sizeof(struct ethhdr);
-  uint16_t h_proto = ntohs(eth->h_proto);
+static void init_eth(packet_wrapper* pw){
+  const struct ethhdr* eth = pw->pkt.caphead.ethhdr;
+  const struct frame_info* info = &pw->pkt.info;
 
   pw->ethhdr = (PyObject*)ethhdr_FromStruct(eth);
-  
- begin:
-  switch ( h_proto ){
-  case ETHERTYPE_VLAN:
-    pw->vlan_tci = ((uint16_t*)payload)[0];
-    h_proto = ntohs(((uint16_t*)payload)[0]);
-    payload = ((char*)eth) + sizeof(struct ethhdr);
-    /* @todo setup access to vlan header */
-    goto begin;
-
-  case ETHERTYPE_IP:
-    init_ipv4(pw, (struct ip*)payload);
-    break;
-
-  case ETHERTYPE_IPV6:
-    Py_INCREF(Py_True);
-    pw->ipv6 = Py_True;
-    break;
-   
-  case ETHERTYPE_ARP:
+
+  /* tags and labels are read in place, the layer 3 offsets already skip them */
+  pw->vlan = PyTuple_New(info->tags);
+  for ( unsigned int i = 0; i < info->tags; i++ ){
+    PyTuple_SET_ITEM(pw->vlan, i, PyInt_FromLong(frame_vlan_tci(&pw->pkt.caphead, info, i)));
+  }
+  if ( info->tags ){
+    pw->vlan_tci = htons(frame_vlan_tci(&pw->pkt.caphead, info, 0));
+  }
+
+  pw->mpls = PyTuple_New(info->labels);
+  for ( unsigned int i = 0; i < info->labels; i++ ){
+    PyTuple_SET_ITEM(pw->mpls, i, PyInt_FromLong(frame_mpls_label(&pw->pkt.caphead, info, i)));
+  }
+
+  /* in a tunnelled packet these are the innermost layers */
+  if ( info->type & PACKET_IP ){
+    pw->ipv4 = (PyObject*)iphdr_FromStruct((const struct ip*)(pw->pkt.buf + info->l3_offset));
+    init_transport(pw, info);
+  } else if ( info->type & PACKET_IPV6 ){
+    /* raw header, extension headers are skipped */
+    pw->ipv6 = PyBuffer_FromMemory(pw->pkt.buf + info->l3_offset, sizeof(struct ip6_hdr));
+    init_transport(pw, info);
+  } else if ( info->type & PACKET_ARP ){
     /* @todo setup wrapper */
     Py_INCREF(Py_True);
     pw->arp_header = Py_True;
-    break;
-
-  case 0x0810: /* MP packet, ignore */
-    return;
+  } else if ( info->ethertype == ETHERTYPE_IPV6 ){
+    /* not fully captured */
+    Py_INCREF(Py_True);
+    pw->ipv6 = Py_True;
+  }
 
-  default:
-    printf("Unknown ethernet protocol (0x%04x)\n", h_proto);
+  pw->tunnel = PyInt_FromLong(info->tunnel);
+  if ( info->tunnel != FRAME_TUNNEL_NONE ){
+    const char* outer = pw->pkt.buf + info->outer_l3_offset;
+    if ( (outer[0] >> 4) == 4 ){
+      pw->outer = (PyObject*)iphdr_FromStruct((const struct ip*)outer);
+    } else {
+      pw->outer = PyBuffer_FromMemory((void*)outer, sizeof(struct ip6_hdr));
+    }
   }
 }
 
@@ -90,6 +92,7 @@ void packet_wrapper_init(packet_wrapper* pw){
 
   pw->iface = PyString_FromFormat("%8s", caphead->nic);
   pw->mampid = PyString_FromFormat("%8s", caphead->mampid);
+  pw->vlan_tci = 0;
   pw->ethhdr = NULL;
   pw->ipv4 = NULL;
   pw->ipv6 = NULL;
@@ -100,8 +103,12 @@ void packet_wrapper_init(packet_wrapper* pw){
   pw->icmphdr = NULL;
   pw->raw = PyBuffer_FromMemory(caphead, sizeof(struct cap_header) + caphead->caplen);
   pw->data = NULL;
+  pw->vlan = NULL;
+  pw->mpls = NULL;
+  pw->tunnel = NULL;
+  pw->outer = NULL;
 
-  init_eth(pw, caphead->ethhdr);
+  init_eth(pw);
 
 #define NONE_if_unset(x) if ( !x ){ Py_INCREF(Py_None); x = Py_None; }
 
@@ -115,12 +122,16 @@ void packet_wrapper_init(packet_wrapper* pw){
   NONE_if_unset(pw->icmphdr);
   NONE_if_unset(pw->raw);
   NONE_if_unset(pw->data);
+  NONE_if_unset(pw->outer);
 }
 
-packet_wrapper* packet_wrapper_new(struct packet* packet){
+packet_wrapper* packet_wrapper_new(const struct packet* packet){
   packet_wrapper* pw = PyObject_New(packet_wrapper, &packet_type);
 
-  memcpy(&pw->pkt, packet, sizeof(struct packet));
+  /* packet is a record in the consumer buffer, so only caplen bytes are present */
+  const size_t len = MIN(packet->caphead.caplen, MAX_CAPTURE_SIZE);
+  memcpy(&pw->pkt, packet, offsetof(struct packet, buf) + len);
+  packet_truncate(&pw->pkt, len);
   packet_wrapper_init(pw);
 
   return pw;
@@ -140,6 +151,10 @@ static void __del__(packet_wrapper* pw){
   if ( pw->icmphdr   ) Py_DECREF(pw->icmphdr);
   if ( pw->raw       ) Py_DECREF(pw->raw);
   if ( pw->data      ) Py_DECREF(pw->data);
+  if ( pw->vlan      ) Py_DECREF(pw->vlan);
+  if ( pw->mpls      ) Py_DECREF(pw->mpls);
+  if ( pw->tunnel    ) Py_DECREF(pw->tunnel);
+  if ( pw->outer     ) Py_DECREF(pw->outer);
   packet_type.tp_free(pw);
 }
 
@@ -164,6 +179,7 @@ static PyObject* __str__(const packet_wrapper* pw){
 }
 
 #define offset_caphead offsetof(packet_wrapper, pkt) + offsetof(struct packet, caphead)
+#define offset_info offsetof(packet_wrapper, pkt) + offsetof(struct packet, info)
 
 static PyMemberDef members[] = {
   {"timestamp", T_OBJECT_EX, offsetof(packet_wrapper, timestamp), READONLY, "Actual arrival time"},
@@ -175,10 +191,11 @@ static PyMemberDef members[] = {
   {"iface",     T_OBJECT_EX, offsetof(packet_wrapper, iface), READONLY, "Capture interface"},
   {"mampid",    T_OBJECT_EX, offsetof(packet_wrapper, mampid), READONLY, "Capture MAMPid"},
 
-  //{"type",    T_INT,       offsetof(packet_wrapper, frame) + offsetof(struct packet_t, type), READONLY, "Frame type"},
+  {"type",      T_UINT,      offset_info + offsetof(struct frame_info, type), READONLY, "Frame type (bitmask)"},
+  {"hash",      T_UINT,      offsetof(packet_wrapper, pkt) + offsetof(struct packet, hash), READONLY, "Flow hash, the same for both directions of a flow"},
   {"ethhdr",    T_OBJECT_EX, offsetof(packet_wrapper, ethhdr), READONLY, "Ethernet header"},
   {"ipv4",      T_OBJECT_EX, offsetof(packet_wrapper, ipv4),  READONLY, "IP header"},
-  {"ipv6",      T_OBJECT_EX, offsetof(packet_wrapper, ipv6),  READONLY, "IP header"},
+  {"ipv6",      T_OBJECT_EX, offsetof(packet_wrapper, ipv6),  READONLY, "IPv6 header (raw)"},
   {"tcphdr",    T_OBJECT_EX, offsetof(packet_wrapper, tcphdr), READONLY, "TCP header"},
   {"udphdr",    T_OBJECT_EX, offsetof(packet_wrapper, udphdr), READONLY, "UDP header"},
   {"icmphdr",   T_OBJECT_EX, offsetof(packet_wrapper, icmphdr), READONLY, "ICMP header"},
@@ -186,6 +203,10 @@ static PyMemberDef members[] = {
 
   {"raw",       T_OBJECT_EX, offsetof(packet_wrapper, raw), READONLY, "raw access to packet"},
   {"payload",   T_OBJECT_EX, offsetof(packet_wrapper, data), READONLY, "packet data after headers"},
+  {"vlan",      T_OBJECT_EX, offsetof(packet_wrapper, vlan), READONLY, "vlan tag control information, outer tag first"},
+  {"mpls",      T_OBJECT_EX, offsetof(packet_wrapper, mpls), READONLY, "mpls labels, outer label first"},
+  {"tunnel",    T_OBJECT_EX, offsetof(packet_wrapper, tunnel), READONLY, "outermost tunnel type, 0 if not tunnelled (the other headers are of the inner packet)"},
+  {"outer",     T_OBJECT_EX, offsetof(packet_wrapper, outer), READONLY, "outer IP header of a tunnelled packet (raw for IPv6)"},
   {NULL},
 };
 
@@ -24,6 +24,10 @@ typedef struct {
   PyObject* icmphdr;
   PyObject* raw;  /* raw access to payload */
   PyObject* data; /* data after headers */
+  PyObject* vlan; /* tuple of vlan tci, outer tag first */
+  PyObject* mpls; /* tuple of mpls labels, outer label first */
+  PyObject* tunnel; /* enum frame_tunnel */
+  PyObject* outer;  /* outer IP header of a tunnelled packet */
 
   /* actual packet */
   struct packet pkt;
@@ -31,7 +35,7 @@ typedef struct {
 
 PyTypeObject packet_type;
 
-packet_wrapper* packet_wrapper_new(struct packet* packet);
+packet_wrapper* packet_wrapper_new(const struct packet* packet);
 void packet_wrapper_init(packet_wrapper* pw);
 
 #endif /* PYCONSUMER_ITERATOR_H */
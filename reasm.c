@@ -0,0 +1,518 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "reasm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+/* largest IP datagram, and largest amount of data in one */
+#define MAX_DATAGRAM 0xFFFF
+
+/**
+ * A parsed fragment, before it is held.
+ */
+struct fragment {
+  struct reasm_key key;
+  size_t offset;
+  size_t length;
+  size_t data;
+  size_t frag_hdr;
+  size_t prev_nxt;
+  int more;
+};
+
+static void counter_add(uint64_t* counter, uint64_t n){
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t timestamp_ns(const struct picotime* ts){
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_psec / 1000;
+}
+
+static size_t key_hash(const struct reasm_key* key){
+  uint64_t word[sizeof(struct reasm_key) / sizeof(uint64_t)];
+  memcpy(word, key, sizeof(word));
+
+  uint64_t hash = 0;
+  for ( size_t i = 0; i < sizeof(word) / sizeof(word[0]); i++ ){
+    hash = (hash ^ word[i]) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+static uint16_t ip_checksum(const void* header, size_t len){
+  const uint8_t* byte = (const uint8_t*)header;
+  uint32_t sum = 0;
+  for ( size_t i = 0; i + 1 < len; i += 2 ){
+    sum += byte[i] << 8 | byte[i + 1];
+  }
+  while ( sum >> 16 ){
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return htons(~sum);
+}
+
+int reasm_init(struct reasm* r, size_t memory, unsigned int timeout, reasm_emit_func emit, void* arg){
+  memset(r, 0, sizeof(struct reasm));
+  r->emit = emit;
+  r->arg = arg;
+
+  /* a datagram holds at least one fragment, so there are never more datagrams
+   * than fragments */
+  r->max_frags = memory / sizeof(struct reasm_frag);
+  if ( r->max_frags == 0 ){
+    r->max_frags = 1;
+  }
+  size_t buckets = 1;
+  while ( buckets < r->max_frags ){
+    buckets <<= 1;
+  }
+  r->bucket_mask = buckets - 1;
+
+  r->tick_ns = (uint64_t)timeout * 1000000 / REASM_TIMEOUT_TICKS;
+  if ( r->tick_ns == 0 ){
+    r->tick_ns = 1;
+  }
+
+  r->frag_pool = malloc(r->max_frags * sizeof(struct reasm_frag));
+  r->datagram_pool = malloc(r->max_frags * sizeof(struct reasm_datagram));
+  r->bucket = calloc(buckets, sizeof(struct reasm_datagram*));
+  r->scratch = malloc(sizeof(struct cap_header) + REASM_FRAG_CAPLEN + MAX_DATAGRAM);
+  if ( !r->frag_pool || !r->datagram_pool || !r->bucket || !r->scratch ){
+    reasm_free(r);
+    return ENOMEM;
+  }
+
+  for ( size_t i = 0; i < r->max_frags; i++ ){
+    r->frag_pool[i].next = i + 1 < r->max_frags ? &r->frag_pool[i + 1] : NULL;
+    r->datagram_pool[i].hash_next = i + 1 < r->max_frags ? &r->datagram_pool[i + 1] : NULL;
+  }
+  r->free_frag = r->frag_pool;
+  r->free_datagram = r->datagram_pool;
+
+  for ( size_t i = 0; i < REASM_WHEEL_SLOTS; i++ ){
+    r->wheel[i].wheel_prev = r->wheel[i].wheel_next = &r->wheel[i];
+  }
+
+  return 0;
+}
+
+void reasm_free(struct reasm* r){
+  free(r->frag_pool);
+  free(r->datagram_pool);
+  free(r->bucket);
+  free(r->scratch);
+  r->frag_pool = NULL;
+  r->datagram_pool = NULL;
+  r->bucket = NULL;
+  r->scratch = NULL;
+}
+
+static struct reasm_datagram** bucket_of(struct reasm* r, const struct reasm_key* key){
+  return &r->bucket[key_hash(key) & r->bucket_mask];
+}
+
+/**
+ * Return a datagram and its fragments to the pools.
+ */
+static void release(struct reasm* r, struct reasm_datagram* dg){
+  struct reasm_datagram** link = bucket_of(r, &dg->key);
+  while ( *link != dg ){
+    link = &(*link)->hash_next;
+  }
+  *link = dg->hash_next;
+
+  dg->wheel_prev->wheel_next = dg->wheel_next;
+  dg->wheel_next->wheel_prev = dg->wheel_prev;
+
+  uint64_t n = 0;
+  while ( dg->frags ){
+    struct reasm_frag* frag = dg->frags;
+    dg->frags = frag->next;
+    frag->next = r->free_frag;
+    r->free_frag = frag;
+    n++;
+  }
+  counter_add(&r->held, -n);
+  counter_add(&r->pending, -1);
+
+  dg->hash_next = r->free_datagram;
+  r->free_datagram = dg;
+}
+
+/**
+ * Give back the fragments of an incomplete datagram as they are, in offset
+ * order, and release it.
+ */
+static void flush(struct reasm* r, struct reasm_datagram* dg){
+  for ( const struct reasm_frag* frag = dg->frags; frag; frag = frag->next ){
+    struct frame_info info = frag->info;
+    info.type |= PACKET_FRAGMENT;
+    r->emit(r->arg, frag->stream_id, &frag->caphead, &info);
+  }
+  release(r, dg);
+}
+
+/**
+ * Flush the datagram which is closest to expiring, except keep.
+ *
+ * @return Zero if there is no such datagram.
+ */
+static int evict_oldest(struct reasm* r, const struct reasm_datagram* keep){
+  for ( uint64_t i = 1; i <= REASM_WHEEL_SLOTS; i++ ){
+    struct reasm_datagram* head = &r->wheel[(r->tick + i) % REASM_WHEEL_SLOTS];
+    for ( struct reasm_datagram* dg = head->wheel_next; dg != head; dg = dg->wheel_next ){
+      if ( dg != keep ){
+	flush(r, dg);
+	counter_add(&r->evicted, 1);
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+void reasm_advance(struct reasm* r, const struct picotime* ts){
+  const uint64_t tick = timestamp_ns(ts) / r->tick_ns;
+  if ( !r->started ){
+    r->tick = tick;
+    r->started = 1;
+    return;
+  }
+  if ( tick <= r->tick ){
+    return;
+  }
+
+  /* after a long gap every slot is visited once */
+  uint64_t t = tick - r->tick > REASM_WHEEL_SLOTS ? tick - REASM_WHEEL_SLOTS : r->tick;
+  r->tick = tick;
+  while ( t++ < tick ){
+    struct reasm_datagram* head = &r->wheel[t % REASM_WHEEL_SLOTS];
+    struct reasm_datagram* dg = head->wheel_next;
+    while ( dg != head ){
+      struct reasm_datagram* next = dg->wheel_next;
+      if ( dg->expire <= tick ){
+	flush(r, dg);
+	counter_add(&r->timeouts, 1);
+      }
+      dg = next;
+    }
+  }
+}
+
+/**
+ * Find the IPv6 fragment header by walking the extension headers (which the
+ * classifier walks past), and the next header field pointing at it.
+ *
+ * @return Offset of the header, 0 if there is none.
+ */
+static size_t ipv6_fragment_header(const char* data, size_t caplen, size_t l3, size_t* prev_nxt){
+  size_t nxt = l3 + offsetof(struct ip6_hdr, ip6_nxt);
+  size_t offset = l3 + sizeof(struct ip6_hdr);
+
+  for (;;){
+    const uint8_t proto = (uint8_t)data[nxt];
+    if ( proto == IPPROTO_FRAGMENT ){
+      if ( caplen < offset + sizeof(struct ip6_frag) ){
+	return 0;
+      }
+      *prev_nxt = nxt;
+      return offset;
+    }
+
+    if ( proto != IPPROTO_HOPOPTS && proto != IPPROTO_ROUTING && proto != IPPROTO_DSTOPTS && proto != IPPROTO_AH ){
+      return 0;
+    }
+    if ( caplen < offset + sizeof(struct ip6_ext) ){
+      return 0;
+    }
+
+    const struct ip6_ext* ext = (const struct ip6_ext*)(data + offset);
+    nxt = offset + offsetof(struct ip6_ext, ip6e_nxt);
+    offset += proto == IPPROTO_AH ? 4 * (ext->ip6e_len + 2) : 8 * (ext->ip6e_len + 1);
+  }
+}
+
+static enum reasm_result parse_ipv4(const char* data, size_t caplen, const struct frame_info* info, struct fragment* frag){
+  const struct ip* ip = (const struct ip*)(data + info->l3_offset);
+  const uint16_t off = ntohs(ip->ip_off);
+  if ( !(off & (IP_MF | IP_OFFMASK)) ){
+    return REASM_NONE;
+  }
+
+  memcpy(frag->key.src, &ip->ip_src, sizeof(struct in_addr));
+  memcpy(frag->key.dst, &ip->ip_dst, sizeof(struct in_addr));
+  frag->key.id = ip->ip_id;
+  frag->key.proto = ip->ip_p;
+  frag->key.version = 4;
+
+  const size_t header = 4 * ip->ip_hl;
+  const size_t len = ntohs(ip->ip_len);
+  if ( header < sizeof(struct ip) || len < header || caplen < info->l3_offset + len ){
+    return REASM_REJECT;
+  }
+
+  frag->offset = 8 * (off & IP_OFFMASK);
+  frag->length = len - header;
+  frag->data = info->l3_offset + header;
+  frag->more = !!(off & IP_MF);
+  return REASM_HELD;
+}
+
+static enum reasm_result parse_ipv6(const char* data, size_t caplen, const struct frame_info* info, struct fragment* frag){
+  const struct ip6_hdr* ip6 = (const struct ip6_hdr*)(data + info->l3_offset);
+
+  /* most packets have no extension headers */
+  switch ( ip6->ip6_nxt ){
+  case IPPROTO_HOPOPTS:
+  case IPPROTO_ROUTING:
+  case IPPROTO_DSTOPTS:
+  case IPPROTO_AH:
+  case IPPROTO_FRAGMENT:
+    break;
+  default:
+    return REASM_NONE;
+  }
+
+  const size_t frag_hdr = ipv6_fragment_header(data, caplen, info->l3_offset, &frag->prev_nxt);
+  if ( frag_hdr == 0 ){
+    return REASM_NONE;
+  }
+
+  /* an atomic fragment (RFC 6946) is a whole packet */
+  const struct ip6_frag* fh = (const struct ip6_frag*)(data + frag_hdr);
+  const size_t offset = ntohs(fh->ip6f_offlg & IP6F_OFF_MASK);
+  const int more = !!(fh->ip6f_offlg & IP6F_MORE_FRAG);
+  if ( offset == 0 && !more ){
+    return REASM_NONE;
+  }
+
+  memcpy(frag->key.src, &ip6->ip6_src, sizeof(struct in6_addr));
+  memcpy(frag->key.dst, &ip6->ip6_dst, sizeof(struct in6_addr));
+  frag->key.id = fh->ip6f_ident;
+  frag->key.proto = fh->ip6f_nxt;
+  frag->key.version = 6;
+
+  const size_t end = info->l3_offset + sizeof(struct ip6_hdr) + ntohs(ip6->ip6_plen);
+  const size_t start = frag_hdr + sizeof(struct ip6_frag);
+  if ( end < start || caplen < end ){
+    return REASM_REJECT;
+  }
+
+  frag->offset = offset;
+  frag->length = end - start;
+  frag->data = start;
+  frag->frag_hdr = frag_hdr;
+  frag->more = more;
+  return REASM_HELD;
+}
+
+/**
+ * Parse the fragment header(s) of a classified frame.
+ *
+ * @return REASM_NONE if the frame isn't a fragment, REASM_REJECT if it is one
+ *         which cannot be held and REASM_HELD otherwise.
+ */
+static enum reasm_result parse_fragment(const char* data, size_t caplen, const struct frame_info* info, struct fragment* frag){
+  enum reasm_result ret;
+  memset(frag, 0, sizeof(struct fragment));
+
+  /* only the outermost IP layer is reassembled, the inner packet of a tunnel
+   * is seen once the outer datagram is complete */
+  if ( info->type & PACKET_TUNNEL ){
+    return REASM_NONE;
+  } else if ( info->type & PACKET_IP ){
+    ret = parse_ipv4(data, caplen, info, frag);
+  } else if ( info->type & PACKET_IPV6 ){
+    ret = parse_ipv6(data, caplen, info, frag);
+  } else {
+    return REASM_NONE;
+  }
+
+  if ( ret != REASM_HELD ){
+    return ret;
+  }
+
+  /* all but the last fragment are multiples of 8 bytes, and the data must fit
+   * in a datagram */
+  if ( (frag->more && (frag->length == 0 || frag->length % 8 != 0)) || frag->offset + frag->length > MAX_DATAGRAM ){
+    return REASM_REJECT;
+  }
+  if ( frag->data + frag->length > REASM_FRAG_CAPLEN ){
+    return REASM_REJECT;
+  }
+  return REASM_HELD;
+}
+
+/**
+ * Whether frag is consistent with what is held of dg: inside the datagram and
+ * not overlapping a held fragment (duplicates included).
+ */
+static int fits(const struct reasm_datagram* dg, const struct fragment* frag){
+  const size_t end = frag->offset + frag->length;
+  if ( dg->total && end > dg->total ){
+    return 0;
+  }
+
+  for ( const struct reasm_frag* held = dg->frags; held; held = held->next ){
+    const size_t held_end = held->offset + held->length;
+    if ( frag->offset < held_end && held->offset < end ){
+      return 0;
+    }
+    if ( !frag->more && held_end > end ){
+      return 0;
+    }
+  }
+
+  return frag->more || !dg->total || dg->total == end;
+}
+
+/**
+ * Emit the complete datagram dg: the link layer and unfragmentable headers of
+ * the first fragment followed by the data, with the headers of the last
+ * fragment received (cp).
+ */
+static void emit_datagram(struct reasm* r, struct reasm_datagram* dg, int stream_id, const struct cap_header* cp){
+  const struct reasm_frag* first = dg->frags;
+  const size_t l3 = first->info.l3_offset;
+  const size_t header = dg->key.version == 4 ? first->data : first->frag_hdr;
+
+  if ( header - l3 + dg->total > MAX_DATAGRAM ){
+    for ( const struct reasm_frag* frag = dg->frags; frag; frag = frag->next ){
+      counter_add(&r->rejected, 1);
+    }
+    flush(r, dg);
+    return;
+  }
+
+  struct cap_header* out = (struct cap_header*)r->scratch;
+  char* buf = r->scratch + sizeof(struct cap_header);
+  memcpy(out, cp, sizeof(struct cap_header));
+  memcpy(buf, first->caphead.payload, header);
+
+  if ( dg->key.version == 4 ){
+    struct ip* ip = (struct ip*)(buf + l3);
+    ip->ip_len = htons(header - l3 + dg->total);
+    ip->ip_off &= htons(IP_DF);
+    ip->ip_sum = 0;
+    ip->ip_sum = ip_checksum(ip, 4 * ip->ip_hl);
+  } else {
+    /* the fragment header is dropped */
+    const struct ip6_frag* fh = (const struct ip6_frag*)(first->caphead.payload + first->frag_hdr);
+    struct ip6_hdr* ip6 = (struct ip6_hdr*)(buf + l3);
+    buf[first->prev_nxt] = fh->ip6f_nxt;
+    ip6->ip6_plen = htons(header - l3 - sizeof(struct ip6_hdr) + dg->total);
+  }
+
+  for ( const struct reasm_frag* frag = dg->frags; frag; frag = frag->next ){
+    memcpy(buf + header + frag->offset, frag->caphead.payload + frag->data, frag->length);
+  }
+  out->caplen = out->len = header + dg->total;
+
+  r->emit(r->arg, stream_id, out, NULL);
+  counter_add(&r->reassembled, 1);
+  release(r, dg);
+}
+
+static struct reasm_datagram* find_datagram(struct reasm* r, const struct reasm_key* key){
+  for ( struct reasm_datagram* dg = *bucket_of(r, key); dg; dg = dg->hash_next ){
+    if ( memcmp(&dg->key, key, sizeof(struct reasm_key)) == 0 ){
+      return dg;
+    }
+  }
+  return NULL;
+}
+
+static struct reasm_datagram* new_datagram(struct reasm* r, const struct reasm_key* key){
+  if ( !r->free_datagram && !evict_oldest(r, NULL) ){
+    return NULL;
+  }
+
+  struct reasm_datagram* dg = r->free_datagram;
+  r->free_datagram = dg->hash_next;
+  memset(dg, 0, sizeof(struct reasm_datagram));
+  dg->key = *key;
+  dg->expire = r->tick + REASM_TIMEOUT_TICKS;
+
+  struct reasm_datagram** bucket = bucket_of(r, key);
+  dg->hash_next = *bucket;
+  *bucket = dg;
+
+  struct reasm_datagram* head = &r->wheel[dg->expire % REASM_WHEEL_SLOTS];
+  dg->wheel_prev = head->wheel_prev;
+  dg->wheel_next = head;
+  head->wheel_prev->wheel_next = dg;
+  head->wheel_prev = dg;
+
+  counter_add(&r->pending, 1);
+  return dg;
+}
+
+enum reasm_result reasm_add(struct reasm* r, int stream_id, const struct cap_header* cp, size_t caplen, const struct frame_info* info){
+  struct fragment frag;
+  const enum reasm_result ret = parse_fragment(cp->payload, caplen, info, &frag);
+  if ( ret == REASM_NONE ){
+    return ret;
+  }
+
+  counter_add(&r->fragments, 1);
+  if ( ret == REASM_REJECT ){
+    counter_add(&r->rejected, 1);
+    return ret;
+  }
+
+  struct reasm_datagram* dg = find_datagram(r, &frag.key);
+  if ( !dg && !(dg=new_datagram(r, &frag.key)) ){
+    counter_add(&r->rejected, 1);
+    return REASM_REJECT;
+  }
+
+  if ( !fits(dg, &frag) || (!r->free_frag && !evict_oldest(r, dg)) ){
+    if ( !dg->frags ){
+      release(r, dg);
+    }
+    counter_add(&r->rejected, 1);
+    return REASM_REJECT;
+  }
+
+  struct reasm_frag* held = r->free_frag;
+  r->free_frag = held->next;
+  held->stream_id = stream_id;
+  held->offset = frag.offset;
+  held->length = frag.length;
+  held->data = frag.data;
+  held->frag_hdr = frag.frag_hdr;
+  held->prev_nxt = frag.prev_nxt;
+  held->info = *info;
+  memcpy(&held->caphead, cp, sizeof(struct cap_header) + frag.data + frag.length);
+  held->caphead.caplen = frag.data + frag.length;
+
+  struct reasm_frag** link = &dg->frags;
+  while ( *link && (*link)->offset < held->offset ){
+    link = &(*link)->next;
+  }
+  held->next = *link;
+  *link = held;
+
+  counter_add(&r->held, 1);
+  if ( r->held > r->held_peak ){
+    counter_add(&r->held_peak, r->held - r->held_peak);
+  }
+
+  dg->received += frag.length;
+  if ( !frag.more ){
+    dg->total = frag.offset + frag.length;
+  }
+  /* the fragments don't overlap, so this means every byte is there */
+  if ( dg->total && dg->received == dg->total ){
+    emit_datagram(r, dg, stream_id, cp);
+  }
+
+  return REASM_HELD;
+}
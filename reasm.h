@@ -0,0 +1,134 @@
+#ifndef CONSUMER_REASM_H
+#define CONSUMER_REASM_H
+
+#include "consumer.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* captured bytes of a fragment which can be held, anything longer is passed on */
+#define REASM_FRAG_CAPLEN MAX_CAPTURE_SIZE
+
+/* the timeout is split into this many ticks, the wheel has twice as many slots */
+#define REASM_TIMEOUT_TICKS 32
+#define REASM_WHEEL_SLOTS (2 * REASM_TIMEOUT_TICKS)
+
+/**
+ * Fragments are identified by (source, destination, identification, protocol)
+ * as in RFC 791 and RFC 8200. Addresses are zero-padded for IPv4 so keys can
+ * be compared with memcmp().
+ */
+struct reasm_key {
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint32_t id;
+  uint8_t proto;
+  uint8_t version;
+  uint16_t reserved;
+};
+
+/**
+ * A held fragment: where its data goes in the datagram and the frame itself.
+ */
+struct reasm_frag {
+  struct reasm_frag* next;  /* in offset order, or next free */
+  int stream_id;
+  uint16_t offset;          /* of the data in the datagram */
+  uint16_t length;          /* of the data */
+  uint16_t data;            /* start of the data in the frame */
+  uint16_t frag_hdr;        /* IPv6 fragment header, 0 for IPv4 */
+  uint16_t prev_nxt;        /* IPv6 next header field pointing at frag_hdr */
+  struct frame_info info;
+  struct cap_header caphead;
+  char buf[REASM_FRAG_CAPLEN];
+};
+
+struct reasm_datagram {
+  struct reasm_datagram* hash_next;  /* bucket chain, or next free */
+  struct reasm_datagram* wheel_prev; /* wheel slot list */
+  struct reasm_datagram* wheel_next;
+  struct reasm_key key;
+  struct reasm_frag* frags;          /* in offset order */
+  uint64_t expire;                   /* tick */
+  uint32_t total;                    /* length of the data, 0 until the last fragment is seen */
+  uint32_t received;                 /* bytes of data held */
+};
+
+/**
+ * Called for each packet the reassembler gives back: a reassembled datagram
+ * (info is NULL, it needs to be classified) or a fragment which could not be
+ * reassembled (info is its classification).
+ */
+typedef void (*reasm_emit_func)(void* arg, int stream_id, const struct cap_header* cp, const struct frame_info* info);
+
+/**
+ * IPv4 and IPv6 fragment reassembly. All memory is allocated up front: a pool
+ * of fragment buffers (the memory limit), a pool of datagrams, the hash table
+ * and a buffer for the datagram being emitted. Incomplete datagrams expire
+ * timeout after their first fragment on a timer wheel driven by the packet
+ * timestamps, and are evicted oldest first when a pool runs out.
+ *
+ * Only accessed by the thread writing to the ring, except for the counters.
+ */
+struct reasm {
+  reasm_emit_func emit;
+  void* arg;
+
+  struct reasm_frag* frag_pool;
+  struct reasm_frag* free_frag;
+  struct reasm_datagram* datagram_pool;
+  struct reasm_datagram* free_datagram;
+  size_t max_frags;
+
+  struct reasm_datagram** bucket;
+  size_t bucket_mask;
+
+  struct reasm_datagram wheel[REASM_WHEEL_SLOTS]; /* list heads */
+  uint64_t tick_ns;
+  uint64_t tick;            /* current tick */
+  int started;              /* tick is set */
+
+  char* scratch;            /* the datagram being emitted */
+
+  uint64_t fragments;       /* fragments seen */
+  uint64_t reassembled;     /* datagrams emitted */
+  uint64_t timeouts;        /* datagrams expired incomplete */
+  uint64_t evicted;         /* datagrams flushed for lack of memory */
+  uint64_t rejected;        /* fragments which could not be held */
+  uint64_t pending;         /* incomplete datagrams */
+  uint64_t held;            /* fragments held */
+  uint64_t held_peak;
+};
+
+/**
+ * @param memory Bytes of fragment buffers, at least one fragment is held.
+ * @param timeout Lifetime of an incomplete datagram in ms.
+ */
+int reasm_init(struct reasm* r, size_t memory, unsigned int timeout, reasm_emit_func emit, void* arg);
+void reasm_free(struct reasm* r);
+
+/**
+ * Expire the datagrams which are due at time ts. Time never goes backwards.
+ */
+void reasm_advance(struct reasm* r, const struct picotime* ts);
+
+enum reasm_result {
+  REASM_NONE = 0,  /* not a fragment */
+  REASM_HELD,      /* taken by the reassembler */
+  REASM_REJECT,    /* a fragment which cannot be reassembled, pass it on */
+};
+
+/**
+ * Offer a classified frame of caplen bytes to the reassembler. Completing a
+ * datagram (or making room for a new one) emits packets before returning.
+ */
+enum reasm_result reasm_add(struct reasm* r, int stream_id, const struct cap_header* cp, size_t caplen, const struct frame_info* info);
+
+/**
+ * Bytes of fragment buffers in use, see struct consumer_reassembly_stats.
+ */
+static inline uint64_t reasm_memory(uint64_t frags){
+  return frags * sizeof(struct reasm_frag);
+}
+
+#endif /* CONSUMER_REASM_H */
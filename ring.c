@@ -0,0 +1,656 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+/* from numaif.h, which requires libnuma */
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+static int futex_wait(uint32_t* addr, uint32_t val, const struct timespec* timeout){
+  return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t* addr){
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static size_t round_pow2(size_t n){
+  size_t p = 1;
+  while ( p < n ){
+    p <<= 1;
+  }
+  return p;
+}
+
+static int numa_bind(void* addr, size_t len, int node){
+  unsigned long mask[node / (8 * sizeof(unsigned long)) + 1];
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, addr, len, MPOL_BIND, mask, 8 * sizeof(mask) + 1, 0) == 0 ? 0 : errno;
+}
+
+/**
+ * Map memory according to mem, see struct ring_mem.
+ */
+static int mem_map(void** addrptr, size_t* map_size, size_t len, const struct ring_mem* mem){
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | (mem->lazy ? MAP_NORESERVE : 0);
+  const size_t page = mem->hugepages ? RING_HUGEPAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+  len = (len + page - 1) & ~(page - 1);
+
+  void* addr = MAP_FAILED;
+  if ( mem->hugepages ){
+    /* without a reservation a fault on an exhausted hugepage pool is SIGBUS,
+     * the pages are faulted in lazily anyway */
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+    if ( addr == MAP_FAILED ){
+      fprintf(stderr, "no hugepages available for a %zu byte buffer, using transparent hugepages\n", len);
+    }
+  }
+  if ( addr == MAP_FAILED ){
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if ( addr == MAP_FAILED ){
+      return errno;
+    }
+    if ( mem->hugepages ){
+      madvise(addr, len, MADV_HUGEPAGE);
+    }
+  }
+
+  /* must precede the first touch for the pages to be placed on the node */
+  int ret;
+  if ( mem->node >= 0 && (ret=numa_bind(addr, len, mem->node)) != 0 ){
+    munmap(addr, len);
+    return ret;
+  }
+
+  if ( !mem->lazy ){
+    for ( size_t offset = 0; offset < len; offset += page ){
+      ((volatile char*)addr)[offset] = 0;
+    }
+  }
+
+  *addrptr = addr;
+  *map_size = len;
+  return 0;
+}
+
+/**
+ * Allocate the slab or metadata array of a ring. map_size is left zero if
+ * allocated from the heap.
+ */
+static int mem_alloc(void** addr, size_t* map_size, size_t len, const struct ring_mem* mem){
+  *map_size = 0;
+  if ( mem && (mem->hugepages || mem->lazy || mem->node >= 0) ){
+    return mem_map(addr, map_size, len, mem);
+  }
+  return posix_memalign(addr, CACHE_LINE, len);
+}
+
+static void mem_free(void* addr, size_t map_size){
+  if ( map_size > 0 ){
+    munmap(addr, map_size);
+  } else {
+    free(addr);
+  }
+}
+
+int ring_init(struct ring* ring, size_t size){
+  return ring_init_mem(ring, size, NULL);
+}
+
+int ring_init_mem(struct ring* ring, size_t size, const struct ring_mem* mem){
+  memset(ring, 0, sizeof(struct ring));
+
+  if ( size > RING_MAX_SIZE ){
+    return EINVAL;
+  }
+
+  /* the ring must be able to hold at least one record of maximum size */
+  const size_t max_record = ring_record_size(MAX_RECORD_CAPLEN);
+  ring->size = round_pow2(size > max_record ? size : max_record);
+  ring->mask = ring->size - 1;
+  ring->meta_mask = ring->size / RING_META_RATIO - 1;
+  ring->active = 1;
+
+  int ret;
+  if ( (ret=mem_alloc((void**)&ring->slab, &ring->map_size, ring->size + max_record, mem)) != 0 ){
+    return ret;
+  }
+  if ( (ret=mem_alloc((void**)&ring->meta, &ring->meta_map_size, (ring->meta_mask + 1) * sizeof(struct ring_meta), mem)) != 0 ){
+    mem_free(ring->slab, ring->map_size);
+    ring->slab = NULL;
+    return ret;
+  }
+  return 0;
+}
+
+void ring_free(struct ring* ring){
+  mem_free(ring->slab, ring->map_size);
+  mem_free(ring->meta, ring->meta_map_size);
+  ring->slab = NULL;
+  ring->meta = NULL;
+}
+
+static inline const struct ring_meta* ring_meta_at(const struct ring* ring, uint64_t seq){
+  return &ring->meta[seq & ring->meta_mask];
+}
+
+/**
+ * Find the metadata entry of the record at pos, starting from a guess which is
+ * never past it (counters are updated after the positions they describe).
+ */
+static uint64_t meta_seq(struct ring* ring, uint64_t guess, uint64_t pos){
+  const uint64_t written = __atomic_load_n(&ring->write_count, __ATOMIC_ACQUIRE);
+  while ( guess < written && ring_meta_at(ring, guess)->pos != (uint32_t)pos ){
+    guess++;
+  }
+  return guess;
+}
+
+/**
+ * Packet described by meta is newer than now.
+ */
+static inline int meta_after(const struct ring_meta* meta, const timepico* now){
+  return meta->tv_sec > now->tv_sec || (meta->tv_sec == now->tv_sec && meta->tv_nsec * 1000ULL > now->tv_psec);
+}
+
+/**
+ * Count the records (at most n) from pos, entry seq, up to write_pos which are
+ * due. Returns the position after the last one.
+ */
+static uint64_t meta_scan(const struct ring* ring, uint64_t seq, uint64_t pos, uint64_t write_pos, size_t n, const timepico* now, size_t* count){
+  size_t i = 0;
+  while ( i < n && pos < write_pos ){
+    const struct ring_meta* meta = ring_meta_at(ring, seq + i);
+    if ( now && meta_after(meta, now) ){
+      break;
+    }
+    pos += ring_record_size(meta->caplen);
+    i++;
+  }
+  *count = i;
+  return pos;
+}
+
+/**
+ * Producer: move the cached tail, and the metadata entry of the record there.
+ */
+static void ring_set_tail(struct ring* ring, uint64_t tail){
+  ring->tail = tail;
+  while ( ring->tail_seq < ring->write_count && ring_meta_at(ring, ring->tail_seq)->pos != (uint32_t)tail ){
+    ring->tail_seq++;
+  }
+}
+
+/**
+ * Position of the slowest cursor, or write_pos if there are no cursors.
+ */
+static uint64_t ring_tail(const struct ring* ring){
+  const uint32_t active = __atomic_load_n(&ring->active, __ATOMIC_ACQUIRE);
+  uint64_t tail = ring->write_pos;
+  for ( int i = 0; i < RING_MAX_CURSORS; i++ ){
+    if ( active & (1U << i) ){
+      const uint64_t pos = __atomic_load_n(&ring->cursor[i].read_pos, __ATOMIC_ACQUIRE) & ~RING_BUSY;
+      if ( pos < tail ){
+	tail = pos;
+      }
+    }
+  }
+  return tail;
+}
+
+/**
+ * Mark the oldest record of a cursor as busy, waiting for anyone else holding
+ * the mark. Returns the position.
+ */
+static uint64_t cursor_lock(struct ring_cursor* cursor){
+  uint64_t pos = __atomic_load_n(&cursor->read_pos, __ATOMIC_ACQUIRE) & ~RING_BUSY;
+  while ( !__atomic_compare_exchange_n(&cursor->read_pos, &pos, pos | RING_BUSY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+    pos &= ~RING_BUSY;
+  }
+  return pos;
+}
+
+struct ring_cursor* ring_cursor_open(struct ring* ring, int oldest){
+  const uint32_t active = __atomic_load_n(&ring->active, __ATOMIC_ACQUIRE);
+  int index = -1;
+  for ( int i = 0; i < RING_MAX_CURSORS; i++ ){
+    if ( !(active & (1U << i)) ){
+      index = i;
+      break;
+    }
+  }
+  if ( index < 0 ){
+    return NULL;
+  }
+
+  /* find the slowest cursor to start from */
+  struct ring_cursor* from = NULL;
+  if ( oldest ){
+    for ( int i = 0; i < RING_MAX_CURSORS; i++ ){
+      if ( (active & (1U << i)) && (!from || (ring->cursor[i].read_pos & ~RING_BUSY) < (from->read_pos & ~RING_BUSY)) ){
+	from = &ring->cursor[i];
+      }
+    }
+  }
+
+  struct ring_cursor* cursor = &ring->cursor[index];
+  if ( from ){
+    /* hold the busy mark of the other cursor so the producer cannot overwrite
+     * anything until the new cursor is active too */
+    const uint64_t pos = cursor_lock(from);
+    cursor->read_pos   = pos;
+    cursor->read_count = from->read_count;
+    cursor->drop_count = __atomic_load_n(&from->drop_count, __ATOMIC_ACQUIRE);
+    __atomic_or_fetch(&ring->active, 1U << index, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&from->read_pos, pos, __ATOMIC_SEQ_CST);
+    if ( from->shared ){
+      ring_advance(ring, from); /* records may have been handed back meanwhile */
+    }
+    return cursor;
+  }
+
+  /* start at write_pos, with write_count matching it: write_count is updated
+   * before and wake_seq after write_pos, so they are equal when write_pos was
+   * read between two commits. */
+  uint32_t seq;
+  uint64_t pos, count;
+  do {
+    seq   = __atomic_load_n(&ring->wake_seq,    __ATOMIC_SEQ_CST);
+    pos   = __atomic_load_n(&ring->write_pos,   __ATOMIC_SEQ_CST);
+    count = __atomic_load_n(&ring->write_count, __ATOMIC_SEQ_CST);
+  } while ( (uint32_t)count != seq );
+
+  cursor->read_pos   = pos;
+  cursor->read_count = count;
+  cursor->drop_count = 0;
+  __atomic_or_fetch(&ring->active, 1U << index, __ATOMIC_SEQ_CST);
+  return cursor;
+}
+
+void ring_cursor_close(struct ring* ring, struct ring_cursor* cursor){
+  __atomic_and_fetch(&ring->active, ~(1U << (cursor - ring->cursor)), __ATOMIC_SEQ_CST);
+
+  /* the producer might be waiting for this cursor */
+  if ( __atomic_load_n(&ring->space_waiting, __ATOMIC_SEQ_CST) ){
+    __atomic_add_fetch(&ring->space_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&ring->space_seq);
+  }
+}
+
+static void deadline_in(struct timespec* deadline, unsigned int timeout){
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec  += timeout / 1000;
+  deadline->tv_nsec += (timeout % 1000) * 1000000;
+  if ( deadline->tv_nsec >= 1000000000 ){
+    deadline->tv_sec += 1;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+/**
+ * Time left until the deadline, returns zero if it has passed.
+ */
+static int time_left(const struct timespec* deadline, struct timespec* left){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  left->tv_sec  = deadline->tv_sec  - now.tv_sec;
+  left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+  if ( left->tv_nsec < 0 ){
+    left->tv_sec -= 1;
+    left->tv_nsec += 1000000000;
+  }
+  return left->tv_sec >= 0;
+}
+
+/**
+ * Out of room for the record, or for its metadata entry.
+ */
+static int ring_full(const struct ring* ring, size_t caplen){
+  return ring->write_pos + ring_record_size(caplen) - ring->tail > ring->size || ring->write_count - ring->tail_seq > ring->meta_mask;
+}
+
+/**
+ * Overwrite the oldest record (at the cached tail) by advancing every cursor
+ * pointing at it. Returns -1 if one of them is busy, in which case nothing is
+ * overwritten unless a consumer marked its cursor busy while the others were
+ * being advanced. The record is counted as dropped (once) as soon as any
+ * cursor loses it.
+ */
+static int ring_overwrite(struct ring* ring){
+  const uint32_t active = __atomic_load_n(&ring->active, __ATOMIC_ACQUIRE);
+  const uint64_t tail = ring->tail;
+  const struct ring_meta* meta = ring_meta_at(ring, ring->tail_seq);
+  const uint64_t next = tail + ring_record_size(meta->caplen);
+
+  /* check every cursor first so the record is normally lost by all or none */
+  for ( int i = 0; i < RING_MAX_CURSORS; i++ ){
+    if ( !(active & (1U << i)) ){
+      continue;
+    }
+    const struct ring_cursor* cursor = &ring->cursor[i];
+    const uint64_t pos = __atomic_load_n(&cursor->read_pos, __ATOMIC_ACQUIRE);
+    if ( (pos & ~RING_BUSY) == tail && ((pos & RING_BUSY) || cursor->shared) ){
+      return -1;
+    }
+  }
+
+  int dropped = 0;
+  int blocked = 0;
+  for ( int i = 0; i < RING_MAX_CURSORS; i++ ){
+    if ( !(active & (1U << i)) ){
+      continue;
+    }
+
+    struct ring_cursor* cursor = &ring->cursor[i];
+    uint64_t pos = __atomic_load_n(&cursor->read_pos, __ATOMIC_ACQUIRE);
+    while ( (pos & ~RING_BUSY) == tail ){
+      if ( pos & RING_BUSY ){
+	blocked = 1;
+	break;
+      }
+      if ( __atomic_compare_exchange_n(&cursor->read_pos, &pos, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+	__atomic_store_n(&cursor->drop_count, cursor->drop_count + 1, __ATOMIC_RELEASE);
+	dropped++;
+	break;
+      }
+    }
+  }
+
+  if ( dropped > 0 && ring->tail_seq >= ring->drop_seq ){
+    ring->drop_seq = ring->tail_seq + 1;
+    __atomic_store_n(&ring->drop_count, ring->drop_count + 1, __ATOMIC_RELAXED);
+    if ( ring->drop_func ){
+      ring->drop_func(ring->drop_ctx, meta);
+    }
+  }
+
+  return blocked ? -1 : dropped;
+}
+
+struct packet* ring_reserve(struct ring* ring, size_t caplen, int overwrite){
+  const uint64_t write_pos = ring->write_pos;
+
+  /* the cursors are only checked when the last known tail is in the way */
+  while ( ring_full(ring, caplen) ){
+    ring_set_tail(ring, ring_tail(ring));
+    if ( !ring_full(ring, caplen) ){
+      break;
+    }
+
+    /* ring is full, overwrite the oldest packet unless it is being read
+     * right now in which case the new packet is discarded instead. */
+    if ( !overwrite || ring_overwrite(ring) < 0 ){
+      return NULL;
+    }
+  }
+
+  return ring_at(ring, write_pos);
+}
+
+void ring_copy_payload(struct ring* ring, void* dst, const void* src, size_t len){
+#ifdef __SSE2__
+  if ( len >= RING_STREAM_MIN ){
+    char* d = dst;
+    const char* s = src;
+    const size_t head = -(uintptr_t)d & 15;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+    for ( ; len >= 16; d += 16, s += 16, len -= 16 ){
+      _mm_stream_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+    }
+    memcpy(d, s, len);
+    ring->streamed = 1;
+    return;
+  }
+#endif
+  memcpy(dst, src, len);
+}
+
+void ring_commit(struct ring* ring, struct packet* pkt){
+  struct ring_meta* meta = &ring->meta[ring->write_count & ring->meta_mask];
+  meta->pos       = (uint32_t)ring->write_pos;
+  meta->tv_sec    = pkt->caphead.ts.tv_sec;
+  meta->tv_nsec   = pkt->caphead.ts.tv_psec / 1000;
+  meta->caplen    = pkt->caphead.caplen;
+  meta->stream_id = pkt->stream_id;
+
+#ifdef __SSE2__
+  /* non-temporal stores are not ordered by the release below */
+  if ( ring->streamed ){
+    _mm_sfence();
+    ring->streamed = 0;
+  }
+#endif
+
+  __atomic_store_n(&ring->write_count, ring->write_count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->write_pos, ring_next(ring, ring->write_pos), __ATOMIC_RELEASE);
+
+  /* only enter the kernel if the consumer is sleeping on an empty ring */
+  __atomic_add_fetch(&ring->wake_seq, 1, __ATOMIC_SEQ_CST);
+  if ( __atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) ){
+    futex_wake(&ring->wake_seq);
+  }
+}
+
+/**
+ * Number of packets which can be read, or claimed from a shared cursor.
+ */
+static size_t ring_available(struct ring* ring, const struct ring_cursor* cursor){
+  if ( !cursor->shared ){
+    return ring_pending(ring, cursor);
+  }
+
+  const uint64_t claimed = __atomic_load_n(&cursor->claim_count, __ATOMIC_ACQUIRE);
+  const uint64_t written = __atomic_load_n(&ring->write_count,   __ATOMIC_ACQUIRE);
+  return written > claimed ? written - claimed : 0;
+}
+
+int ring_wait(struct ring* ring, struct ring_cursor* cursor, unsigned int timeout){
+  struct timespec deadline, left;
+  deadline_in(&deadline, timeout);
+
+  for (;;){
+    const uint32_t seq = __atomic_load_n(&ring->wake_seq, __ATOMIC_SEQ_CST);
+    if ( ring_available(ring, cursor) > 0 ){
+      return 1;
+    }
+
+    if ( !time_left(&deadline, &left) ){
+      return 0;
+    }
+
+    __atomic_add_fetch(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    if ( futex_wait(&ring->wake_seq, seq, &left) != 0 && errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR ){
+      fprintf(stderr, "futex_wait() returned %d: %s\n", errno, strerror(errno));
+    }
+    __atomic_sub_fetch(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+int ring_wait_space(struct ring* ring, size_t caplen, unsigned int timeout){
+  struct timespec deadline, left;
+  deadline_in(&deadline, timeout);
+
+  for (;;){
+    /* announce the waiter before checking so ring_release() either sees it or
+     * has already moved read_pos */
+    __atomic_add_fetch(&ring->space_waiting, 1, __ATOMIC_SEQ_CST);
+    const uint32_t seq = __atomic_load_n(&ring->space_seq, __ATOMIC_SEQ_CST);
+    ring_set_tail(ring, ring_tail(ring));
+    int ret = !ring_full(ring, caplen);
+
+    if ( !ret && time_left(&deadline, &left) ){
+      if ( futex_wait(&ring->space_seq, seq, &left) != 0 && errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR ){
+	fprintf(stderr, "futex_wait() returned %d: %s\n", errno, strerror(errno));
+      }
+      ret = -1; /* check again */
+    }
+    __atomic_sub_fetch(&ring->space_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if ( ret >= 0 ){
+      return ret;
+    }
+  }
+}
+
+uint64_t ring_claim(struct ring* ring, struct ring_cursor* cursor, size_t n, const timepico* now, size_t* count){
+  /* mark the oldest record as busy so the producer leaves it (and the
+   * records after it) alone */
+  const uint64_t read_pos = cursor_lock(cursor);
+  const uint64_t write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+
+  /* the producer may not yet have counted a record it just overwrote */
+  const uint64_t seq = meta_seq(ring, cursor->read_count + __atomic_load_n(&cursor->drop_count, __ATOMIC_ACQUIRE), read_pos);
+
+  /* packets are stored in arrival order so the first one which isn't due yet
+   * ends the batch */
+  size_t i;
+  meta_scan(ring, seq, read_pos, write_pos, n, now, &i);
+
+  if ( i == 0 ){
+    __atomic_store_n(&cursor->read_pos, read_pos, __ATOMIC_RELEASE);
+  }
+
+  *count = i;
+  return read_pos;
+}
+
+uint64_t ring_claim_shared(struct ring* ring, struct ring_cursor* cursor, size_t n, const timepico* now, size_t* count){
+  uint64_t start;
+  size_t i;
+
+  for (;;){
+    /* claim_count is updated after claim_pos, so reading it first gives a
+     * guess which is never past the entry of start */
+    const uint64_t claimed = __atomic_load_n(&cursor->claim_count, __ATOMIC_SEQ_CST);
+    start = __atomic_load_n(&cursor->claim_pos, __ATOMIC_SEQ_CST);
+    const uint64_t write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+
+    /* the records may be handed back and reused by the time the CAS is made,
+     * in which case the CAS fails as claim_pos has moved */
+    const uint64_t seq = meta_seq(ring, claimed, start);
+    const uint64_t pos = meta_scan(ring, seq, start, write_pos, n, now, &i);
+
+    if ( i == 0 || __atomic_compare_exchange_n(&cursor->claim_pos, &start, pos, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+      break;
+    }
+  }
+
+  if ( i > 0 ){
+    __atomic_add_fetch(&cursor->claim_count, i, __ATOMIC_RELEASE);
+  }
+
+  *count = i;
+  return start;
+}
+
+void ring_advance(struct ring* ring, struct ring_cursor* cursor){
+  /* read_pos is locked with the busy mark while advancing. A consumer which
+   * finds it locked leaves: the one holding the lock checks again after
+   * unlocking and will see the records handed back in the meantime. */
+  for (;;){
+    uint64_t pos = __atomic_load_n(&cursor->read_pos, __ATOMIC_SEQ_CST);
+    const uint64_t claimed = __atomic_load_n(&cursor->claim_pos, __ATOMIC_SEQ_CST);
+    if ( (pos & RING_BUSY) || pos >= claimed || __atomic_load_n(&ring_at(ring, pos)->used, __ATOMIC_SEQ_CST) ){
+      return;
+    }
+    if ( !__atomic_compare_exchange_n(&cursor->read_pos, &pos, pos | RING_BUSY, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ){
+      continue;
+    }
+
+    size_t n = 0;
+    while ( pos < claimed && __atomic_load_n(&ring_at(ring, pos)->used, __ATOMIC_SEQ_CST) == 0 ){
+      pos = ring_next(ring, pos);
+      n++;
+    }
+
+    ring_release(ring, cursor, pos, n);
+  }
+}
+
+static void meta_time(const struct ring_meta* meta, timepico* ts){
+  ts->tv_sec  = meta->tv_sec;
+  ts->tv_psec = meta->tv_nsec * 1000ULL;
+}
+
+int ring_head_time(struct ring* ring, struct ring_cursor* cursor, timepico* ts){
+  if ( cursor->shared ){
+    /* nothing is overwritten, at worst the timestamp is of a later packet */
+    const uint64_t claimed = __atomic_load_n(&cursor->claim_count, __ATOMIC_SEQ_CST);
+    const uint64_t pos = __atomic_load_n(&cursor->claim_pos, __ATOMIC_SEQ_CST);
+    if ( pos >= __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE) ){
+      return 0;
+    }
+    meta_time(ring_meta_at(ring, meta_seq(ring, claimed, pos)), ts);
+    return 1;
+  }
+
+  size_t count;
+  const uint64_t read_pos = ring_claim(ring, cursor, 1, NULL, &count);
+  if ( count == 0 ){
+    return 0;
+  }
+
+  meta_time(ring_meta_at(ring, meta_seq(ring, cursor->read_count + __atomic_load_n(&cursor->drop_count, __ATOMIC_ACQUIRE), read_pos)), ts);
+  __atomic_store_n(&cursor->read_pos, read_pos, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void ring_release(struct ring* ring, struct ring_cursor* cursor, uint64_t pos, size_t n){
+  cursor->read_count += n;
+  __atomic_store_n(&cursor->read_pos, pos, __ATOMIC_SEQ_CST);
+
+  /* only enter the kernel if the producer is blocked on a full ring */
+  if ( __atomic_load_n(&ring->space_waiting, __ATOMIC_SEQ_CST) ){
+    __atomic_add_fetch(&ring->space_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&ring->space_seq);
+  }
+}
+
+size_t ring_pending(struct ring* ring, const struct ring_cursor* cursor){
+  const uint64_t read    = __atomic_load_n(&cursor->read_count, __ATOMIC_ACQUIRE);
+  const uint64_t dropped = __atomic_load_n(&cursor->drop_count, __ATOMIC_ACQUIRE);
+  const uint64_t written = __atomic_load_n(&ring->write_count,  __ATOMIC_ACQUIRE);
+
+  /* the counters are not read atomically as a whole */
+  const int64_t pending = (int64_t)(written - dropped - read);
+  return pending > 0 ? (size_t)pending : 0;
+}
+
+void ring_bell_ring(struct ring_bell* bell){
+  __atomic_add_fetch(&bell->seq, 1, __ATOMIC_SEQ_CST);
+  if ( __atomic_load_n(&bell->waiting, __ATOMIC_SEQ_CST) ){
+    futex_wake(&bell->seq);
+  }
+}
+
+void ring_bell_wait(struct ring_bell* bell, uint32_t seq, unsigned int timeout){
+  const struct timespec left = {timeout / 1000, (timeout % 1000) * 1000000};
+  __atomic_add_fetch(&bell->waiting, 1, __ATOMIC_SEQ_CST);
+  if ( futex_wait(&bell->seq, seq, &left) != 0 && errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR ){
+    fprintf(stderr, "futex_wait() returned %d: %s\n", errno, strerror(errno));
+  }
+  __atomic_sub_fetch(&bell->waiting, 1, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,282 @@
+#ifndef CONSUMER_RING_H
+#define CONSUMER_RING_H
+
+#include "consumer.h"
+
+#include <stdint.h>
+#include <stddef.h> /* offsetof */
+
+#define CACHE_LINE 64
+
+/* Records in the ring are padded to this alignment */
+#define RECORD_ALIGN 8
+
+/* Largest caplen that will be stored, anything longer is truncated */
+#define MAX_RECORD_CAPLEN 0xFFFF
+
+/* Set in read_pos while the consumer is reading the record it points at. The
+ * producer will never overwrite a busy record (or the ones after it). */
+#define RING_BUSY (1ULL << 63)
+
+/* Largest ring (after rounding up), positions are kept in 32 bits in struct
+ * ring_meta */
+#define RING_MAX_SIZE (1ULL << 31)
+
+/* Max number of readers of a ring */
+#define RING_MAX_CURSORS 16
+
+/* Size of the pages used by ring_mem.hugepages */
+#define RING_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* Bytes of slab per metadata entry, i.e. a ring holds at most size / 64
+ * records however short they are */
+#define RING_META_RATIO 64
+
+/* Payload copies of at least this many bytes bypass the cache, see
+ * ring_copy_payload() */
+#define RING_STREAM_MIN 256
+
+/**
+ * Compact copy of the record header fields needed to scan the ring (due
+ * checks, record sizes, drop accounting) without touching the slab. Entry
+ * seq & meta_mask describes the seq:th record written.
+ */
+struct ring_meta {
+  uint32_t pos;       /* low bits of the record position, to find a record by position */
+  uint32_t tv_sec;
+  uint32_t tv_nsec;   /* timestamp truncated to ns */
+  uint16_t caplen;
+  uint16_t stream_id;
+};
+
+/**
+ * Called by the producer for each record overwritten to make room for a new
+ * one, before the record is reused.
+ */
+typedef void (*ring_drop_func)(void* ctx, const struct ring_meta* meta);
+
+/**
+ * Read position of one consumer. Each cursor sees every packet written while
+ * it is open (unless overwritten) independently of the other cursors.
+ */
+struct ring_cursor {
+  uint64_t read_pos    __attribute__((aligned(CACHE_LINE)));
+  uint64_t read_count;  /* packets read, written by the consumer only */
+  uint64_t drop_count;  /* packets overwritten before being read, written by the producer only */
+
+  /* Shared cursors are read by several consumers: records are claimed in
+   * batches by moving claim_pos (CAS) and handed back in any order by marking
+   * them as unused. Whoever finds the oldest records handed back moves
+   * read_pos past them. The producer never overwrites a shared cursor. */
+  int shared;
+  uint64_t claim_pos   __attribute__((aligned(CACHE_LINE)));
+  uint64_t claim_count;
+};
+
+/**
+ * Lock-free single-producer ring of variable-length records (the header of
+ * struct packet followed by caplen bytes) with one or more consumers, each
+ * with its own cursor. The producer owns write_pos and each consumer the
+ * read_pos of its cursor, except when the ring is full and overwriting is
+ * allowed: then the producer advances the slowest cursors itself (using CAS)
+ * to overwrite the oldest packets. The slowest cursor thus decides where the
+ * producer has to stop or overwrite. Both positions are byte offsets which
+ * increase monotonically and are masked when indexing, so size is always a
+ * power of two.
+ *
+ * A record is never split. Instead the slab has room for one maximum sized
+ * record past the end so a record starting near the end simply continues into
+ * it, while the next record starts at the beginning again.
+ *
+ * The producer also writes a metadata entry for each record to a separate
+ * array, the hot part of the ring, so scans over timestamps and lengths stream
+ * through 16 byte entries instead of one slab cache line per record. The array
+ * is never overwritten before the record itself, i.e. a ring is also full when
+ * it holds size / RING_META_RATIO records. Positions only differ within a
+ * ring, so size is at most RING_MAX_SIZE.
+ */
+struct ring {
+  size_t size;
+  size_t mask;
+  char* slab;
+  size_t map_size;  /* length of the mapping, 0 if the slab is from posix_memalign() */
+  struct ring_meta* meta;
+  size_t meta_mask;
+  size_t meta_map_size;
+  ring_drop_func drop_func; /* optional */
+  void* drop_ctx;
+
+  /* written by the producer only */
+  uint64_t write_pos   __attribute__((aligned(CACHE_LINE)));
+  uint64_t write_count; /* packets written */
+  uint64_t drop_count;  /* packets overwritten (for any cursor) */
+  uint64_t drop_seq;    /* metadata entry after the last record counted as overwritten */
+  uint64_t tail;        /* slowest cursor when last checked */
+  uint64_t tail_seq;    /* metadata entry of the record at tail */
+  int streamed;         /* non-temporal stores made since the last commit */
+
+  /* futex word, bumped for each packet written */
+  uint32_t wake_seq    __attribute__((aligned(CACHE_LINE)));
+  uint32_t waiting;
+
+  /* futex word, bumped when space is released to a waiting producer */
+  uint32_t space_seq;
+  uint32_t space_waiting;
+
+  uint32_t claimed;     /* cursors allocated */
+  uint32_t active;      /* cursors initialized, only these are considered by the producer */
+  struct ring_cursor cursor[RING_MAX_CURSORS];
+};
+
+/**
+ * How the slab is allocated. By default it comes from the heap. Otherwise it
+ * is mapped, optionally with hugepages (transparent hugepages are requested
+ * instead if none are reserved) and bound to a NUMA node, and unless lazy is
+ * set every page is faulted in up front so no faults are taken while packets
+ * are stored. Lazy mappings use MAP_NORESERVE, except for reserved
+ * hugepages.
+ */
+struct ring_mem {
+  int hugepages;
+  int lazy;
+  int node; /* -1 for any */
+};
+
+/**
+ * Initialize a ring. Cursor 0 is opened at the start. Returns EINVAL if size
+ * is larger than RING_MAX_SIZE.
+ *
+ * @param mem NULL to allocate the slab from the heap.
+ */
+int ring_init(struct ring* ring, size_t size);
+int ring_init_mem(struct ring* ring, size_t size, const struct ring_mem* mem);
+void ring_free(struct ring* ring);
+
+/**
+ * Size of a record holding caplen bytes.
+ */
+static inline size_t ring_record_size(size_t caplen){
+  return (offsetof(struct packet, buf) + caplen + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+static inline struct packet* ring_at(const struct ring* ring, uint64_t pos){
+  return (struct packet*)(ring->slab + (pos & ring->mask));
+}
+
+static inline uint64_t ring_next(const struct ring* ring, uint64_t pos){
+  return pos + ring_record_size(ring_at(ring, pos)->caphead.caplen);
+}
+
+/**
+ * Open a new cursor, starting at the newest packet or (if oldest is set) at
+ * the oldest packet still unread by any cursor. Returns NULL if all cursors
+ * are in use. Opening and closing cursors must be serialized by the caller.
+ */
+struct ring_cursor* ring_cursor_open(struct ring* ring, int oldest);
+
+/**
+ * Close a cursor, the producer will no longer wait for it.
+ */
+void ring_cursor_close(struct ring* ring, struct ring_cursor* cursor);
+
+/**
+ * Producer: make room for a record of caplen bytes. If the ring is full the
+ * oldest packets are overwritten when overwrite is set. Returns NULL if the
+ * ring is full and nothing could (or may) be overwritten, i.e. the new packet
+ * must be discarded or the producer has to wait for space.
+ */
+struct packet* ring_reserve(struct ring* ring, size_t caplen, int overwrite);
+
+/**
+ * Producer: block until there is room for a record of caplen bytes or the
+ * timeout (in ms) expires. Returns non-zero if there is room.
+ */
+int ring_wait_space(struct ring* ring, size_t caplen, unsigned int timeout);
+
+/**
+ * Producer: copy payload into a reserved record. Large copies use
+ * non-temporal stores when available, so packets passing through do not evict
+ * the producer's working set from the cache.
+ */
+void ring_copy_payload(struct ring* ring, void* dst, const void* src, size_t len);
+
+/**
+ * Producer: publish the record returned by ring_reserve(). The record header
+ * must be complete.
+ */
+void ring_commit(struct ring* ring, struct packet* pkt);
+
+/**
+ * Consumer: block until there are packets to read (or claim) from the cursor or the
+ * timeout (in ms) expires. Returns non-zero if there are packets to read.
+ */
+int ring_wait(struct ring* ring, struct ring_cursor* cursor, unsigned int timeout);
+
+/**
+ * Consumer: mark the oldest record as busy and count how many packets (at most
+ * n) from there on are due, i.e. not newer than now to the nanosecond (NULL to
+ * skip the check).
+ * Returns the position of the first record. If no packets are due the busy
+ * mark is cleared again.
+ */
+uint64_t ring_claim(struct ring* ring, struct ring_cursor* cursor, size_t n, const timepico* now, size_t* count);
+
+/**
+ * Shared consumer: claim up to n of the oldest unclaimed packets which are due
+ * (see ring_claim()). Returns the position of the first record. The records
+ * are handed back with ring_mark_done() followed by ring_advance().
+ */
+uint64_t ring_claim_shared(struct ring* ring, struct ring_cursor* cursor, size_t n, const timepico* now, size_t* count);
+
+static inline void ring_mark_done(const struct packet* pkt){
+  __atomic_store_n(&((struct packet*)pkt)->used, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Shared consumer: move read_pos past the oldest records handed back.
+ */
+void ring_advance(struct ring* ring, struct ring_cursor* cursor);
+
+/**
+ * Consumer: get the timestamp of the oldest record. Returns zero if there is
+ * nothing to read.
+ */
+int ring_head_time(struct ring* ring, struct ring_cursor* cursor, timepico* ts);
+
+/**
+ * Consumer: hand back n claimed records, pos being the end of the last one.
+ */
+void ring_release(struct ring* ring, struct ring_cursor* cursor, uint64_t pos, size_t n);
+
+/**
+ * Number of unread packets.
+ */
+size_t ring_pending(struct ring* ring, const struct ring_cursor* cursor);
+
+/**
+ * Number of unread bytes (including record headers and padding).
+ */
+static inline size_t ring_lag(const struct ring* ring, const struct ring_cursor* cursor){
+  const uint64_t write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+  const uint64_t read_pos = __atomic_load_n(&cursor->read_pos, __ATOMIC_ACQUIRE) & ~RING_BUSY;
+  return write_pos > read_pos ? write_pos - read_pos : 0;
+}
+
+/**
+ * Wakeup counter for a consumer waiting on several rings at once. The
+ * producer rings it after committing to any of them.
+ */
+struct ring_bell {
+  uint32_t seq;
+  uint32_t waiting;
+};
+
+void ring_bell_ring(struct ring_bell* bell);
+
+/**
+ * Block until the bell is rung after seq was read from it, or the timeout
+ * (in ms) expires. Spurious wakeups are possible.
+ */
+void ring_bell_wait(struct ring_bell* bell, uint32_t seq, unsigned int timeout);
+
+#endif /* CONSUMER_RING_H */
@@ -0,0 +1,149 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "spill.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* smallest record, a segment with less than this left is skipped */
+#define MIN_RECORD ring_record_size(0)
+
+int spill_init(struct spill* spill, const char* dir, size_t segment_size, size_t max_segments){
+  memset(spill, 0, sizeof(struct spill));
+
+  /* a segment must hold at least one record of maximum size */
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t max_record = ring_record_size(MAX_RECORD_CAPLEN);
+  if ( segment_size < max_record ){
+    segment_size = max_record;
+  }
+  spill->segment_size = (segment_size + page - 1) & ~(page - 1);
+  spill->max_segments = max_segments > 0 ? max_segments : 1;
+
+  spill->dir = strdup(dir);
+  spill->segment = calloc(spill->max_segments, sizeof(struct spill_segment));
+  if ( !spill->dir || !spill->segment ){
+    spill_free(spill);
+    return ENOMEM;
+  }
+
+  return 0;
+}
+
+void spill_free(struct spill* spill){
+  for ( size_t i = 0; i < spill->num_segments; i++ ){
+    munmap(spill->segment[i].map, spill->segment_size);
+    close(spill->segment[i].fd);
+  }
+  free(spill->segment);
+  free(spill->dir);
+  spill->segment = NULL;
+  spill->dir = NULL;
+  spill->num_segments = 0;
+}
+
+/**
+ * Create the next segment file. The file is unlinked right away so nothing is
+ * left behind if the process dies.
+ */
+static int create_segment(struct spill* spill){
+  struct spill_segment* seg = &spill->segment[spill->num_segments];
+  char filename[strlen(spill->dir) + 32];
+  sprintf(filename, "%s/consumer-spill-XXXXXX", spill->dir);
+
+  if ( (seg->fd=mkstemp(filename)) < 0 ){
+    return errno;
+  }
+  unlink(filename);
+
+  int ret;
+  if ( (ret=posix_fallocate(seg->fd, 0, spill->segment_size)) != 0 ){
+    close(seg->fd);
+    return ret;
+  }
+
+  seg->map = mmap(NULL, spill->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+  if ( seg->map == MAP_FAILED ){
+    ret = errno;
+    close(seg->fd);
+    return ret;
+  }
+
+  spill->num_segments++;
+  return 0;
+}
+
+static char* spill_at(const struct spill* spill, uint64_t pos){
+  const size_t index = (pos / spill->segment_size) % spill->max_segments;
+  return spill->segment[index].map + pos % spill->segment_size;
+}
+
+/**
+ * Position of the next record at or after pos, skipping the end of a segment
+ * which is too short to hold a record of the given size.
+ */
+static uint64_t spill_align(const struct spill* spill, uint64_t pos, size_t size){
+  const size_t left = spill->segment_size - pos % spill->segment_size;
+  return left < size ? pos + left : pos;
+}
+
+struct packet* spill_reserve(struct spill* spill, size_t caplen){
+  const size_t size = ring_record_size(caplen);
+  const uint64_t pos = spill_align(spill, spill->write_pos, size);
+  if ( pos + size - spill->read_pos > spill->segment_size * spill->max_segments ){
+    return NULL;
+  }
+
+  const size_t index = (pos / spill->segment_size) % spill->max_segments;
+  if ( index >= spill->num_segments ){
+    int ret;
+    if ( (ret=create_segment(spill)) != 0 ){
+      if ( spill->num_segments == 0 ){
+	fprintf(stderr, "failed to create spill segment in %s: %s\n", spill->dir, strerror(ret));
+      }
+      return NULL;
+    }
+  }
+
+  /* mark the skipped end of the segment so the reader follows */
+  if ( pos != spill->write_pos ){
+    if ( spill->segment_size - spill->write_pos % spill->segment_size >= MIN_RECORD ){
+      ((struct packet*)spill_at(spill, spill->write_pos))->used = 0;
+    }
+    spill->write_pos = pos;
+  }
+
+  return (struct packet*)spill_at(spill, pos);
+}
+
+void spill_commit(struct spill* spill, struct packet* pkt){
+  spill->write_pos += ring_record_size(pkt->caphead.caplen);
+  __atomic_store_n(&spill->spilled, spill->spilled + 1, __ATOMIC_RELAXED);
+}
+
+const struct packet* spill_peek(struct spill* spill){
+  if ( spill_empty(spill) ){
+    return NULL;
+  }
+
+  /* skip to the next segment if the rest of this one is unused */
+  const size_t left = spill->segment_size - spill->read_pos % spill->segment_size;
+  if ( left < MIN_RECORD || ((const struct packet*)spill_at(spill, spill->read_pos))->used == 0 ){
+    spill->read_pos += left;
+  }
+
+  return (const struct packet*)spill_at(spill, spill->read_pos);
+}
+
+void spill_consume(struct spill* spill){
+  const struct packet* pkt = (const struct packet*)spill_at(spill, spill->read_pos);
+  spill->read_pos += ring_record_size(pkt->caphead.caplen);
+  __atomic_store_n(&spill->recovered, spill->recovered + 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,68 @@
+#ifndef CONSUMER_SPILL_H
+#define CONSUMER_SPILL_H
+
+#include "ring.h"
+
+struct spill_segment {
+  int fd;
+  char* map;
+};
+
+/**
+ * Overflow storage on disk for packets which do not fit in the ring. Records
+ * (same format as in the ring) are appended to a sequence of fixed-size,
+ * pre-allocated and mmap'd segment files which are reused circularly, so disk
+ * usage is bounded by segment_size * max_segments. A record never spans two
+ * segments; the rest of a segment is skipped when the next record does not
+ * fit.
+ *
+ * Only accessed by the thread writing to the ring (which both spills and
+ * refills the ring from the spill), except for the counters.
+ */
+struct spill {
+  char* dir;
+  size_t segment_size;
+  size_t max_segments;
+  struct spill_segment* segment; /* created on demand */
+  size_t num_segments;
+
+  /* byte offsets into the sequence, increase monotonically */
+  uint64_t write_pos;
+  uint64_t read_pos;
+
+  uint64_t spilled;   /* packets written */
+  uint64_t recovered; /* packets read back */
+};
+
+/**
+ * @param dir Directory to create the (unlinked) segment files in.
+ */
+int spill_init(struct spill* spill, const char* dir, size_t segment_size, size_t max_segments);
+void spill_free(struct spill* spill);
+
+static inline int spill_empty(const struct spill* spill){
+  return spill->read_pos == spill->write_pos;
+}
+
+/**
+ * Make room for a record of caplen bytes. Returns NULL if the spill is full or
+ * a segment could not be created.
+ */
+struct packet* spill_reserve(struct spill* spill, size_t caplen);
+
+/**
+ * Append the record returned by spill_reserve(). caphead.caplen must be set.
+ */
+void spill_commit(struct spill* spill, struct packet* pkt);
+
+/**
+ * Oldest record or NULL if the spill is empty.
+ */
+const struct packet* spill_peek(struct spill* spill);
+
+/**
+ * Remove the record returned by spill_peek().
+ */
+void spill_consume(struct spill* spill);
+
+#endif /* CONSUMER_SPILL_H */
@@ -0,0 +1,306 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "consumer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <assert.h>
+#include <netinet/ip.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TUPLES_SIMD 1
+#endif
+
+/* arrays are aligned and padded to a cache line */
+#define TUPLES_ALIGN 64
+
+static const size_t info_offset = offsetof(struct packet, info);
+static const size_t len_offset = offsetof(struct packet, caphead) + offsetof(struct cap_header, len);
+static const size_t buf_offset = offsetof(struct packet, buf);
+static const size_t hash_offset = offsetof(struct packet, hash);
+
+static uint64_t timestamp_ns(const struct packet* pkt){
+  return (uint64_t)pkt->caphead.ts.tv_sec * 1000000000ULL + pkt->caphead.ts.tv_psec / 1000;
+}
+
+static void timestamps(struct packet_tuples* t, const struct packet** pkt, size_t n){
+  for ( size_t i = 0; i < n; i++ ){
+    t->timestamp[i] = timestamp_ns(pkt[i]);
+  }
+}
+
+static void extract_scalar(struct packet_tuples* t, const struct packet** pkt, size_t begin, size_t end){
+  for ( size_t i = begin; i < end; i++ ){
+    const struct frame_info* info = &pkt[i]->info;
+    uint32_t addr[2] = {0, 0};
+    uint16_t port[2] = {0, 0};
+
+    if ( info->type & PACKET_IP ){
+      memcpy(addr, pkt[i]->buf + info->l3_offset + offsetof(struct ip, ip_src), sizeof(addr));
+    }
+    if ( info->type & (TRANSPORT_TCP | TRANSPORT_UDP) ){
+      memcpy(port, pkt[i]->buf + info->l4_offset, sizeof(port));
+    }
+
+    t->type[i]     = info->type;
+    t->proto[i]    = info->proto;
+    t->src_ip[i]   = ntohl(addr[0]);
+    t->dst_ip[i]   = ntohl(addr[1]);
+    t->src_port[i] = ntohs(port[0]);
+    t->dst_port[i] = ntohs(port[1]);
+    t->len[i]      = pkt[i]->caphead.len;
+    t->hash[i]     = pkt[i]->hash;
+  }
+}
+
+#ifdef TUPLES_SIMD
+
+/**
+ * Load the source and destination address and the ports of a packet, zero
+ * where the header isn't present.
+ */
+static inline void load_tuple(const struct packet* pkt, uint32_t* src, uint32_t* dst, uint32_t* ports){
+  *src = *dst = *ports = 0;
+  if ( pkt->info.type & PACKET_IP ){
+    const char* addr = pkt->buf + pkt->info.l3_offset + offsetof(struct ip, ip_src);
+    memcpy(src, addr, sizeof(uint32_t));
+    memcpy(dst, addr + sizeof(uint32_t), sizeof(uint32_t));
+  }
+  if ( pkt->info.type & (TRANSPORT_TCP | TRANSPORT_UDP) ){
+    memcpy(ports, pkt->buf + pkt->info.l4_offset, sizeof(uint32_t));
+  }
+}
+
+/**
+ * Four packets at a time, the loads are scalar but the byte swapping and
+ * narrowing is done in vector registers.
+ */
+__attribute__((target("sse4.1")))
+static void extract_sse4(struct packet_tuples* t, const struct packet** pkt, size_t n){
+  const __m128i bswap32 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  const __m128i bswap16 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  const __m128i narrow8 = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i low16 = _mm_set1_epi32(0xffff);
+  size_t i = 0;
+
+  for ( ; i + 4 <= n; i += 4 ){
+    const struct packet* p0 = pkt[i + 0];
+    const struct packet* p1 = pkt[i + 1];
+    const struct packet* p2 = pkt[i + 2];
+    const struct packet* p3 = pkt[i + 3];
+    uint32_t src[4], dst[4], port[4];
+    load_tuple(p0, &src[0], &dst[0], &port[0]);
+    load_tuple(p1, &src[1], &dst[1], &port[1]);
+    load_tuple(p2, &src[2], &dst[2], &port[2]);
+    load_tuple(p3, &src[3], &dst[3], &port[3]);
+
+    const __m128i vsrc = _mm_setr_epi32(src[0], src[1], src[2], src[3]);
+    const __m128i vdst = _mm_setr_epi32(dst[0], dst[1], dst[2], dst[3]);
+    const __m128i vport = _mm_shuffle_epi8(_mm_setr_epi32(port[0], port[1], port[2], port[3]), bswap16);
+    const __m128i vports = _mm_packus_epi32(_mm_and_si128(vport, low16), _mm_srli_epi32(vport, 16));
+    const __m128i vproto = _mm_shuffle_epi8(_mm_setr_epi32(p0->info.proto, p1->info.proto, p2->info.proto, p3->info.proto), narrow8);
+
+    _mm_storeu_si128((__m128i*)&t->type[i], _mm_setr_epi32(p0->info.type, p1->info.type, p2->info.type, p3->info.type));
+    _mm_storeu_si128((__m128i*)&t->src_ip[i], _mm_shuffle_epi8(vsrc, bswap32));
+    _mm_storeu_si128((__m128i*)&t->dst_ip[i], _mm_shuffle_epi8(vdst, bswap32));
+    _mm_storeu_si128((__m128i*)&t->len[i], _mm_setr_epi32(p0->caphead.len, p1->caphead.len, p2->caphead.len, p3->caphead.len));
+    _mm_storeu_si128((__m128i*)&t->hash[i], _mm_setr_epi32(p0->hash, p1->hash, p2->hash, p3->hash));
+    _mm_storel_epi64((__m128i*)&t->src_port[i], vports);
+    _mm_storel_epi64((__m128i*)&t->dst_port[i], _mm_srli_si128(vports, 8));
+    const uint32_t proto = _mm_cvtsi128_si32(vproto);
+    memcpy(&t->proto[i], &proto, sizeof(proto));
+  }
+
+  extract_scalar(t, pkt, i, n);
+}
+
+/**
+ * Four slot pointers as 64-bit gather indices, plus a constant offset.
+ */
+__attribute__((target("avx2")))
+static inline __m256i slot_address(const struct packet** pkt, size_t offset){
+  return _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)pkt), _mm256_set1_epi64x(offset));
+}
+
+/**
+ * Eight packets at a time: every field is fetched with (masked) gathers
+ * indexed by the slot pointers, so nothing goes through general purpose
+ * registers.
+ */
+__attribute__((target("avx2")))
+static void extract_avx2(struct packet_tuples* t, const struct packet** pkt, size_t n){
+  const __m256i bswap32 = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+					   3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  const __m128i bswap16 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  const __m128i ip_bit = _mm_set1_epi32(PACKET_IP);
+  const __m128i port_bits = _mm_set1_epi32(TRANSPORT_TCP | TRANSPORT_UDP);
+  const __m128i low16 = _mm_set1_epi32(0xffff);
+  const __m128i zero = _mm_setzero_si128();
+  const int* base = NULL; /* the indices are absolute addresses */
+  size_t i = 0;
+
+  for ( ; i + 8 <= n; i += 8 ){
+    __m128i type[2], proto[2], src[2], dst[2], port[2], len[2], hash[2];
+
+    for ( int h = 0; h < 2; h++ ){
+      const __m256i info = slot_address(pkt + i + 4*h, info_offset);
+      const __m256i buf = slot_address(pkt + i + 4*h, buf_offset);
+
+      type[h] = _mm256_i64gather_epi32(base, info, 1);
+      const __m128i word = _mm256_i64gather_epi32(base, _mm256_add_epi64(info, _mm256_set1_epi64x(offsetof(struct frame_info, ethertype))), 1);
+      const __m128i offsets = _mm256_i64gather_epi32(base, _mm256_add_epi64(info, _mm256_set1_epi64x(offsetof(struct frame_info, l3_offset))), 1);
+      len[h] = _mm256_i64gather_epi32(base, slot_address(pkt + i + 4*h, len_offset), 1);
+      hash[h] = _mm256_i64gather_epi32(base, slot_address(pkt + i + 4*h, hash_offset), 1);
+      proto[h] = _mm_and_si128(_mm_srli_epi32(word, 16), _mm_set1_epi32(0xff));
+
+      /* addresses and ports are only read where the header is present */
+      const __m128i ip = _mm_cmpeq_epi32(_mm_and_si128(type[h], ip_bit), ip_bit);
+      const __m128i ports = _mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(type[h], port_bits), zero), _mm_cmpeq_epi32(zero, zero));
+
+      const __m256i l3 = _mm256_add_epi64(buf, _mm256_cvtepu16_epi64(_mm_shuffle_epi8(offsets, _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1))));
+      const __m256i l4 = _mm256_add_epi64(buf, _mm256_cvtepu16_epi64(_mm_shuffle_epi8(offsets, _mm_setr_epi8(2, 3, 6, 7, 10, 11, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1))));
+
+      const __m256i addr = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), (const long long*)base, _mm256_add_epi64(l3, _mm256_set1_epi64x(offsetof(struct ip, ip_src))), _mm256_cvtepi32_epi64(ip), 1);
+      const __m256i swapped = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(addr, bswap32), split);
+      src[h] = _mm256_castsi256_si128(swapped);
+      dst[h] = _mm256_extracti128_si256(swapped, 1);
+
+      port[h] = _mm_shuffle_epi8(_mm256_mask_i64gather_epi32(zero, base, l4, ports, 1), bswap16);
+    }
+
+    _mm_storeu_si128((__m128i*)&t->type[i], type[0]);
+    _mm_storeu_si128((__m128i*)&t->type[i + 4], type[1]);
+    _mm_storeu_si128((__m128i*)&t->src_ip[i], src[0]);
+    _mm_storeu_si128((__m128i*)&t->src_ip[i + 4], src[1]);
+    _mm_storeu_si128((__m128i*)&t->dst_ip[i], dst[0]);
+    _mm_storeu_si128((__m128i*)&t->dst_ip[i + 4], dst[1]);
+    _mm_storeu_si128((__m128i*)&t->len[i], len[0]);
+    _mm_storeu_si128((__m128i*)&t->len[i + 4], len[1]);
+    _mm_storeu_si128((__m128i*)&t->hash[i], hash[0]);
+    _mm_storeu_si128((__m128i*)&t->hash[i + 4], hash[1]);
+    _mm_storeu_si128((__m128i*)&t->src_port[i], _mm_packus_epi32(_mm_and_si128(port[0], low16), _mm_and_si128(port[1], low16)));
+    _mm_storeu_si128((__m128i*)&t->dst_port[i], _mm_packus_epi32(_mm_srli_epi32(port[0], 16), _mm_srli_epi32(port[1], 16)));
+    _mm_storel_epi64((__m128i*)&t->proto[i], _mm_packus_epi16(_mm_packus_epi32(proto[0], proto[1]), zero));
+  }
+
+  extract_scalar(t, pkt, i, n);
+}
+
+#endif /* TUPLES_SIMD */
+
+static int kernel_supported(enum tuples_kernel kernel){
+  switch ( kernel ){
+  case TUPLES_SCALAR:
+    return 1;
+#ifdef TUPLES_SIMD
+  case TUPLES_SSE4:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+  case TUPLES_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
+  }
+}
+
+const char* packet_tuples_kernel_name(int kernel){
+  switch ( kernel ){
+  case TUPLES_AUTO:   return "auto";
+  case TUPLES_SCALAR: return "scalar";
+  case TUPLES_SSE4:   return "sse4";
+  case TUPLES_AVX2:   return "avx2";
+  default:            return "invalid kernel";
+  }
+}
+
+int packet_tuples_init(struct packet_tuples* t, size_t capacity, enum tuples_kernel kernel){
+  assert(t);
+
+  if ( capacity == 0 ){
+    return EINVAL;
+  }
+
+  if ( kernel == TUPLES_AUTO ){
+    /* the gathers of the avx2 kernel measure no faster than the scalar loads
+     * of the sse4 kernel (see consumer-bench), so it is only used on request */
+    kernel = kernel_supported(TUPLES_SSE4) ? TUPLES_SSE4 : TUPLES_SCALAR;
+  } else if ( !kernel_supported(kernel) ){
+    return ENOTSUP;
+  }
+
+  /* every array is padded to a whole number of cache lines */
+  const size_t pad = TUPLES_ALIGN - 1;
+  const size_t size[] = {
+    (capacity * sizeof(uint32_t) + pad) & ~pad, /* type */
+    (capacity * sizeof(uint32_t) + pad) & ~pad, /* src_ip */
+    (capacity * sizeof(uint32_t) + pad) & ~pad, /* dst_ip */
+    (capacity * sizeof(uint32_t) + pad) & ~pad, /* len */
+    (capacity * sizeof(uint32_t) + pad) & ~pad, /* hash */
+    (capacity * sizeof(uint64_t) + pad) & ~pad, /* timestamp */
+    (capacity * sizeof(uint16_t) + pad) & ~pad, /* src_port */
+    (capacity * sizeof(uint16_t) + pad) & ~pad, /* dst_port */
+    (capacity * sizeof(uint8_t)  + pad) & ~pad, /* proto */
+    (capacity * sizeof(void*)    + pad) & ~pad, /* pkt */
+  };
+  size_t total = 0;
+  for ( size_t i = 0; i < sizeof(size) / sizeof(size[0]); i++ ){
+    total += size[i];
+  }
+
+  char* mem;
+  if ( posix_memalign((void**)&mem, TUPLES_ALIGN, total) != 0 ){
+    return ENOMEM;
+  }
+  memset(t, 0, sizeof(struct packet_tuples));
+  t->capacity  = capacity;
+  t->kernel    = kernel;
+  t->type      = (uint32_t*)mem; mem += size[0];
+  t->src_ip    = (uint32_t*)mem; mem += size[1];
+  t->dst_ip    = (uint32_t*)mem; mem += size[2];
+  t->len       = (uint32_t*)mem; mem += size[3];
+  t->hash      = (uint32_t*)mem; mem += size[4];
+  t->timestamp = (uint64_t*)mem; mem += size[5];
+  t->src_port  = (uint16_t*)mem; mem += size[6];
+  t->dst_port  = (uint16_t*)mem; mem += size[7];
+  t->proto     = (uint8_t*)mem;  mem += size[8];
+  t->pkt       = (const struct packet**)mem;
+
+  return 0;
+}
+
+void packet_tuples_free(struct packet_tuples* t){
+  free(t->type); /* start of the allocation */
+  memset(t, 0, sizeof(struct packet_tuples));
+}
+
+size_t packet_tuples_extract(struct packet_tuples* t, const struct packet** pkt, size_t n){
+  if ( n > t->capacity ){
+    n = t->capacity;
+  }
+
+  switch ( t->kernel ){
+#ifdef TUPLES_SIMD
+  case TUPLES_AVX2:
+    extract_avx2(t, pkt, n);
+    break;
+  case TUPLES_SSE4:
+    extract_sse4(t, pkt, n);
+    break;
+#endif
+  default:
+    extract_scalar(t, pkt, 0, n);
+    break;
+  }
+  timestamps(t, pkt, n);
+
+  t->n = n;
+  return n;
+}